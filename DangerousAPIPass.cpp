@@ -1,27 +1,1872 @@
 //===- DangerousAPIPass.cpp - Instrument dangerous API calls --------------===//
 //
-// LLVM Pass to instrument strcpy calls for dynamic profiling
+// LLVM Pass to instrument dangerous libc API calls for dynamic profiling
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Instrumentation.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/EscapeEnumerator.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "dangerous-api"
+
+STATISTIC(NumSitesInstrumented, "Number of dangerous call sites instrumented");
+STATISTIC(NumFortifiedSites, "Number of fortified (__X_chk) sites instrumented");
+STATISTIC(NumIntrinsicSites, "Number of memory intrinsic sites instrumented");
+STATISTIC(NumIndirectSites, "Number of indirect call sites instrumented");
+STATISTIC(NumCCTFunctions, "Number of functions given CCT entry/exit hooks");
+STATISTIC(NumTripCountSites, "Number of sites counted from loop trip counts");
+STATISTIC(NumRegisterSites, "Number of sites accumulated in registers");
+STATISTIC(NumEdgeCounters, "Number of CFG edge counters placed");
+STATISTIC(NumEdgeProfiledSites, "Number of sites recovered from edge profiles");
+STATISTIC(NumSiteGroups, "Number of control-equivalent site groups counted");
+STATISTIC(NumGroupedSites, "Number of sites counted by a group counter");
+STATISTIC(NumElidedSites, "Number of provably bounded sites left alone");
+STATISTIC(NumWarmSites, "Number of profile-warm sites given inline counters");
+STATISTIC(NumHotSites, "Number of profile-hot sites sampled");
+STATISTIC(NumSleds, "Number of patchable sleds emitted");
+STATISTIC(NumGatedSites, "Number of sites behind an enable byte");
+STATISTIC(NumSampledFunctions, "Number of functions duplicated for sampling");
+STATISTIC(NumSampledSites, "Number of sites instrumented in sampled copies");
+STATISTIC(NumAccumulatedSites, "Number of sites counted per invocation");
+
+static cl::opt<std::string> ClCatalogFile(
+    "dangerous-api-catalog",
+    cl::desc("File listing the APIs to instrument, one name per line "
+             "('#' starts a comment); defaults to the built-in catalog"),
+    cl::value_desc("filename"), cl::init(""));
+
+// The runtime's DANGEROUS_API_STACK_DEPTH mode walks the frame-pointer
+// chain, which only works if every frame on the way keeps one.
+static cl::opt<bool> ClKeepFramePointers(
+    "dangerous-api-frame-pointers",
+    cl::desc("Force frame pointers in every function so the profiling "
+             "runtime can capture full call stacks"),
+    cl::init(false));
+
+static cl::opt<bool> ClCallingContext(
+    "dangerous-api-pcc",
+    cl::desc("Maintain a probabilistic calling-context value that the "
+             "profiling runtime uses as the context key of every hit"),
+    cl::init(false));
+
+static cl::opt<bool> ClCallingContextTree(
+    "dangerous-api-cct",
+    cl::desc("Insert function entry/exit hooks so the profiling runtime "
+             "can build a calling-context tree"),
+    cl::init(false));
+
+static cl::opt<bool> ClIndirectCalls(
+    "dangerous-api-indirect",
+    cl::desc("Check indirect call targets against the runtime's table of "
+             "dangerous function addresses"),
+    cl::init(false));
+
+static cl::opt<bool> ClMemIntrinsics(
+    "dangerous-api-mem-intrinsics",
+    cl::desc("Also instrument llvm.memcpy/memmove/memset calls whose length "
+             "is not a compile-time constant, recording the length"),
+    cl::init(false));
+
+static cl::opt<bool> ClElideBounded(
+    "dangerous-api-elide-bounded",
+    cl::desc("Leave copies that provably fit their destination "
+             "uninstrumented and list them in the profile as elided"),
+    cl::init(true));
+
+static cl::opt<bool> ClProfileGuided(
+    "dangerous-api-profile-guided",
+    cl::desc("In modules with a PGO profile, keep full hooks for cold sites "
+             "only: warm sites get inline counters and hot sites are "
+             "sampled"),
+    cl::init(true));
+
+// The runtime only ships the preserve_most shims of its hooks for x86-64
+static cl::opt<bool> ClPreserveMost(
+    "dangerous-api-preserve-most",
+    cl::desc("Call the logging hooks with the preserve_most convention so "
+             "sites keep their values in registers across them (x86-64)"),
+    cl::init(true));
+
+static cl::opt<bool> ClOutline(
+    "dangerous-api-outline",
+    cl::desc("Move the rare reports behind an inline fast path, those of "
+             "profile-hot sites and of sampled copies, into a cold stub per "
+             "hook and API in .text.unlikely"),
+    cl::init(false));
+
+static cl::opt<unsigned> ClHotSamples(
+    "dangerous-api-hot-samples",
+    cl::desc("Runtime calls a profile-hot site should make over a run like "
+             "the profiled one; sets its compile-time sampling period "
+             "(0 is treated as 1)"),
+    cl::init(1024));
+
+// How a dangerous call site is counted
+enum class CountingMode {
+  Call,    // call the runtime at every execution
+  Promote, // hoist counts of sites in loops to the loop exits
+  Spanning, // count non-spanning-tree CFG edges, solve sites at exit
+  Groups,   // one counter per group of control-equivalent sites
+  Estimate, // no instrumentation, counts estimated from a PGO profile
+  Sleds,    // patchable no-op sleds the runtime turns on and off
+  Gated,    // per-call hooks behind per-site enable bytes
+  Sampling, // per-call hooks in a duplicate entered every Nth check
+  Accumulate, // count locally, add to a shared counter at function exits
+};
+
+static cl::opt<CountingMode> ClCounting(
+    "dangerous-api-counting",
+    cl::desc("How dangerous call sites are counted"),
+    cl::values(clEnumValN(CountingMode::Call, "call",
+                          "Call the profiling runtime at every site (default)"),
+               clEnumValN(CountingMode::Promote, "promote",
+                          "Count sites in loops once per loop exit, from the "
+                          "trip count when it is computable and from a "
+                          "register otherwise"),
+               clEnumValN(CountingMode::Spanning, "spanning",
+                          "Count only the CFG edges off a spanning tree and "
+                          "recover the site counts when the profile is "
+                          "written"),
+               clEnumValN(CountingMode::Groups, "groups",
+                          "Share one counter between the sites of "
+                          "control-equivalent blocks"),
+               clEnumValN(CountingMode::Estimate, "estimate",
+                          "Insert nothing; estimate site counts from the "
+                          "PGO block counts and write them to a sidecar "
+                          "file"),
+               clEnumValN(CountingMode::Sleds, "sleds",
+                          "Emit no-op sleds the runtime can patch into "
+                          "calls to the profiler while the program runs "
+                          "(x86-64)"),
+               clEnumValN(CountingMode::Gated, "gated",
+                          "Guard each per-call hook with a per-site enable "
+                          "byte the runtime can flip"),
+               clEnumValN(CountingMode::Sampling, "sampling",
+                          "Duplicate functions with sites and run the "
+                          "instrumented copy once every N entries and "
+                          "back edges (Arnold-Ryder)"),
+               clEnumValN(CountingMode::Accumulate, "accumulate",
+                          "Count sites in a local per invocation and add it "
+                          "to a shared counter at every return and unwind "
+                          "edge")),
+    cl::init(CountingMode::Call));
+
+static cl::opt<std::string> ClEstimateOutput(
+    "dangerous-api-estimate-output",
+    cl::desc("Sidecar written by -dangerous-api-counting=estimate "
+             "(default: <source file>.dangerous_api_profile.json)"),
+    cl::value_desc("filename"));
+
+// Must match TARGET_FILTER_BYTES and TARGET_FILTER_SHIFT in the runtime
+static const unsigned TargetFilterBits = 4096 * 8;
+static const unsigned TargetFilterShift = 4;
+
 namespace {
 
+// APIs instrumented when no -dangerous-api-catalog file is given: unbounded
+// copies and concatenations, format-string and scanf families, and other
+// calls commonly banned by secure-coding guides.
+static const char *const DefaultCatalog[] = {
+    // String copy and concatenation
+    "strcpy", "strncpy", "stpcpy", "stpncpy", "strcat", "strncat",
+    "strlcpy", "strlcat", "wcscpy", "wcsncpy", "wcscat", "wcsncat",
+    "strdup", "strndup", "strtok", "wcstok",
+    // Raw memory copies
+    "memcpy", "mempcpy", "memmove", "memccpy", "bcopy", "wmemcpy",
+    "wmemmove",
+    // Unbounded reads
+    "gets", "getwd", "getpass",
+    // Formatted output
+    "sprintf", "vsprintf", "snprintf", "vsnprintf", "swprintf",
+    "vswprintf", "asprintf", "vasprintf", "printf", "vprintf", "fprintf",
+    "vfprintf", "dprintf", "vdprintf", "syslog", "vsyslog",
+    // Formatted input
+    "scanf", "fscanf", "sscanf", "vscanf", "vfscanf", "vsscanf", "wscanf",
+    "fwscanf", "swscanf",
+    // Unchecked conversions
+    "atoi", "atol", "atoll", "atof",
+    // Racy temporary files, paths and command execution
+    "tmpnam", "tempnam", "mktemp", "realpath", "system", "popen",
+};
+
+// How to recover the number of bytes a copy-family API moves: either from a
+// NUL-terminated source string (the runtime measures it) or from an explicit
+// size operand. DstArg is the destination the copy starts at, for APIs
+// whose writes end within those bytes; appending APIs have none. An index
+// of -1 means "not used".
+struct CopySizeSpec {
+  const char *Name;
+  int DstArg;
+  int SrcArg;
+  int SizeArg;
+};
+
+static const CopySizeSpec CopySizeSpecs[] = {
+    {"strcpy", 0, 1, -1},   {"stpcpy", 0, 1, -1},   {"strcat", -1, 1, -1},
+    {"strncpy", 0, -1, 2},  {"stpncpy", 0, -1, 2},  {"strncat", -1, -1, 2},
+    {"strlcpy", 0, -1, 2},  {"strlcat", -1, -1, 2}, {"memcpy", 0, -1, 2},
+    {"mempcpy", 0, -1, 2},  {"memmove", 0, -1, 2},  {"memccpy", 0, -1, 3},
+    {"bcopy", 1, -1, 2},
+    // Memory intrinsics, see -dangerous-api-mem-intrinsics
+    {"llvm.memcpy", 0, -1, 2}, {"llvm.memmove", 0, -1, 2},
+    {"llvm.memset", 0, -1, 2},
+};
+
+static const CopySizeSpec *findCopySizeSpec(StringRef Name) {
+  for (const CopySizeSpec &Spec : CopySizeSpecs)
+    if (Name == Spec.Name)
+      return &Spec;
+  return nullptr;
+}
+
+// Variants of catalog entries that TargetLibraryInfo models as LibFuncs of
+// their own: the _FORTIFY_SOURCE checked functions and glibc's ISO C99
+// scanf aliases.
+struct LibFuncAlias {
+  LibFunc Variant;
+  LibFunc Base;
+  bool Fortified;
+};
+
+static const LibFuncAlias LibFuncAliases[] = {
+    {LibFunc_strcpy_chk, LibFunc_strcpy, true},
+    {LibFunc_stpcpy_chk, LibFunc_stpcpy, true},
+    {LibFunc_strncpy_chk, LibFunc_strncpy, true},
+    {LibFunc_stpncpy_chk, LibFunc_stpncpy, true},
+    {LibFunc_strcat_chk, LibFunc_strcat, true},
+    {LibFunc_strncat_chk, LibFunc_strncat, true},
+    {LibFunc_strlcpy_chk, LibFunc_strlcpy, true},
+    {LibFunc_strlcat_chk, LibFunc_strlcat, true},
+    {LibFunc_memcpy_chk, LibFunc_memcpy, true},
+    {LibFunc_mempcpy_chk, LibFunc_mempcpy, true},
+    {LibFunc_memmove_chk, LibFunc_memmove, true},
+    {LibFunc_memccpy_chk, LibFunc_memccpy, true},
+    {LibFunc_sprintf_chk, LibFunc_sprintf, true},
+    {LibFunc_snprintf_chk, LibFunc_snprintf, true},
+    {LibFunc_vsprintf_chk, LibFunc_vsprintf, true},
+    {LibFunc_vsnprintf_chk, LibFunc_vsnprintf, true},
+    {LibFunc_dunder_isoc99_scanf, LibFunc_scanf, false},
+    {LibFunc_dunder_isoc99_sscanf, LibFunc_sscanf, false},
+};
+
+// The catalog entry a declared function stands for
+struct APIInfo {
+  StringRef Name;
+  bool Fortified;
+};
+
+// Hands out one NUL-terminated string constant per distinct string in the
+// module. The constants are private and unnamed_addr, which puts them in
+// mergeable string sections, so the linker also folds duplicates across
+// translation units.
+class StringPool {
+  Module &M;
+  StringMap<Constant*> Strings;
+  
+public:
+  explicit StringPool(Module &M) : M(M) {}
+  
+  Constant *get(StringRef Str) {
+    Constant *&Slot = Strings[Str];
+    if (!Slot)
+      Slot = ConstantExpr::getPointerCast(
+          createPrivateGlobalForString(M, Str, /*AllowMerging=*/true,
+                                       "dangerous_api.str"),
+          PointerType::getUnqual(M.getContext()));
+    return Slot;
+  }
+};
+
+// Declares a runtime hook. None of them unwind, which keeps them plain
+// calls inside EH regions and lets EscapeEnumerator leave them alone.
+static FunctionCallee getRuntimeHook(Module &M, StringRef Name,
+                                     FunctionType *Ty) {
+  FunctionCallee Hook = M.getOrInsertFunction(Name, Ty);
+  if (auto *Fn = dyn_cast<Function>(Hook.getCallee()))
+    Fn->addFnAttr(Attribute::NoUnwind);
+  return Hook;
+}
+
+// Module-wide counters and static tables for the sites whose counts the
+// runtime works out when the profile is written, and for the sites left
+// uninstrumented. Functions add their tables as they are instrumented;
+// finalize() sizes the counter array and hands the descriptor to
+// profiling_register_module() from a constructor. The layouts must match
+// the Dangerous* structs of the runtime.
+class CounterModule {
+  Module &M;
+  Type *PtrTy, *Int32Ty, *Int64Ty;
+  StructType *EdgeTy, *SiteTy, *GroupTy, *FunctionTy, *ElidedTy;
+  // An i64 placeholder until finalize() knows the number of counters
+  GlobalVariable *Counters = nullptr;
+  unsigned NumCounters = 0;
+  std::vector<Constant*> Functions;
+  std::vector<Constant*> Elided;
+  
+  Constant *table(StructType *Ty, ArrayRef<Constant*> Elts,
+                  const Twine &Name) {
+    if (Elts.empty())
+      return ConstantPointerNull::get(cast<PointerType>(PtrTy));
+    ArrayType *TableTy = ArrayType::get(Ty, Elts.size());
+    return new GlobalVariable(M, TableTy, /*isConstant=*/true,
+                              GlobalValue::PrivateLinkage,
+                              ConstantArray::get(TableTy, Elts), Name);
+  }
+  
+public:
+  explicit CounterModule(Module &M) : M(M) {
+    LLVMContext &Ctx = M.getContext();
+    PtrTy = PointerType::getUnqual(Ctx);
+    Int32Ty = Type::getInt32Ty(Ctx);
+    Int64Ty = Type::getInt64Ty(Ctx);
+    EdgeTy = StructType::get(Int32Ty, Int32Ty, Int32Ty);
+    SiteTy = StructType::get(PtrTy, Int32Ty);
+    GroupTy = StructType::get(Int32Ty, Int32Ty, Int32Ty, Int32Ty);
+    FunctionTy = StructType::get(PtrTy, Int32Ty, Int32Ty, Int32Ty, Int32Ty,
+                                 PtrTy, PtrTy, PtrTy);
+    ElidedTy = StructType::get(PtrTy, PtrTy, Int64Ty, Int64Ty);
+  }
+  
+  unsigned allocateCounter() { return NumCounters++; }
+  
+  // Counters are bumped atomically, like every count in the runtime, by
+  // one unless Amount is given. Returns the counter's previous value.
+  Value *emitIncrement(IRBuilder<> &Builder, unsigned Idx,
+                       Value *Amount = nullptr) {
+    if (!Counters)
+      Counters = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                                    GlobalValue::PrivateLinkage,
+                                    ConstantInt::get(Int64Ty, 0),
+                                    "__dangerous_api_counters");
+    Constant *Addr = ConstantExpr::getInBoundsGetElementPtr(
+        Int64Ty, Counters, ConstantInt::get(Int64Ty, Idx));
+    if (!Amount)
+      Amount = ConstantInt::get(Int64Ty, 1);
+    return Builder.CreateAtomicRMW(AtomicRMWInst::Add, Addr, Amount,
+                                   MaybeAlign(8), AtomicOrdering::Monotonic);
+  }
+  
+  // Counter is -1 for edges whose count the runtime solves for
+  Constant *edge(unsigned Src, unsigned Dst, int Counter) {
+    return ConstantStruct::get(EdgeTy, {ConstantInt::get(Int32Ty, Src),
+                                        ConstantInt::get(Int32Ty, Dst),
+                                        ConstantInt::get(Int32Ty, Counter)});
+  }
+  
+  // Node is the site's CFG node, or -1 for sites counted by a group
+  Constant *site(Constant *APIName, int Node) {
+    return ConstantStruct::get(SiteTy,
+                               {APIName, ConstantInt::get(Int32Ty, Node)});
+  }
+  
+  // A group's sites are consecutive in the function's site table. A group
+  // with a sampling period already reported every full period itself and
+  // leaves only the remainder to the runtime.
+  Constant *group(unsigned Counter, unsigned FirstSite, unsigned NumSites,
+                  unsigned Period = 0) {
+    return ConstantStruct::get(GroupTy,
+                               {ConstantInt::get(Int32Ty, Counter),
+                                ConstantInt::get(Int32Ty, FirstSite),
+                                ConstantInt::get(Int32Ty, NumSites),
+                                ConstantInt::get(Int32Ty, Period)});
+  }
+  
+  void addFunction(Constant *Name, unsigned NumNodes,
+                   ArrayRef<Constant*> Edges, ArrayRef<Constant*> Sites,
+                   ArrayRef<Constant*> Groups = {}) {
+    Functions.push_back(ConstantStruct::get(
+        FunctionTy,
+        {Name, ConstantInt::get(Int32Ty, NumNodes),
+         ConstantInt::get(Int32Ty, Edges.size()),
+         ConstantInt::get(Int32Ty, Sites.size()),
+         ConstantInt::get(Int32Ty, Groups.size()),
+         table(EdgeTy, Edges, "__dangerous_api_edges"),
+         table(SiteTy, Sites, "__dangerous_api_sites"),
+         table(GroupTy, Groups, "__dangerous_api_groups")}));
+  }
+  
+  // A site left uninstrumented because its copy of Bytes bytes provably
+  // fits the ObjectBytes left in its destination
+  void addElided(Constant *APIName, Constant *CallerName, uint64_t Bytes,
+                 uint64_t ObjectBytes) {
+    Elided.push_back(ConstantStruct::get(
+        ElidedTy, {APIName, CallerName, ConstantInt::get(Int64Ty, Bytes),
+                   ConstantInt::get(Int64Ty, ObjectBytes)}));
+  }
+  
+  void finalize() {
+    if (Functions.empty() && Elided.empty())
+      return;
+    
+    LLVMContext &Ctx = M.getContext();
+    Constant *CounterArray = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+    if (Counters) {
+      ArrayType *CountersTy = ArrayType::get(Int64Ty, NumCounters);
+      auto *Array = new GlobalVariable(
+          M, CountersTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+          ConstantAggregateZero::get(CountersTy));
+      Array->takeName(Counters);
+      Counters->replaceAllUsesWith(Array);
+      Counters->eraseFromParent();
+      CounterArray = Array;
+    }
+    
+    // Writable: the runtime links registered modules through the last field
+    StructType *ModuleTy =
+        StructType::get(Int32Ty, Int32Ty, PtrTy, PtrTy, PtrTy, PtrTy);
+    auto *Descriptor = new GlobalVariable(
+        M, ModuleTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+        ConstantStruct::get(
+            ModuleTy,
+            {ConstantInt::get(Int32Ty, Functions.size()),
+             ConstantInt::get(Int32Ty, Elided.size()),
+             table(FunctionTy, Functions, "__dangerous_api_functions"),
+             table(ElidedTy, Elided, "__dangerous_api_elided"), CounterArray,
+             ConstantPointerNull::get(cast<PointerType>(PtrTy))}),
+        "__dangerous_api_module");
+    
+    // void profiling_register_module(DangerousModule* module)
+    FunctionCallee RegisterFunc = getRuntimeHook(
+        M, "profiling_register_module",
+        FunctionType::get(Type::getVoidTy(Ctx), {PtrTy}, false));
+    Function *Ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "dangerous_api.register_module", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Ctor));
+    Builder.CreateCall(RegisterFunc, {Descriptor});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, 1);
+  }
+};
+
 struct DangerousAPIPass : public PassInfoMixin<DangerousAPIPass> {
+  // Names of the APIs to instrument, filled once per pass instance
+  StringSet<> Catalog;
+  bool CatalogLoaded = false;
+  
+  // Catalog entries TargetLibraryInfo knows, as LibFunc bits
+  BitVector CatalogFuncs;
+  
+  // Runtime hooks, declared per module by run()
+  FunctionCallee LogFunc, LogSizeFunc, LogStrFunc, LogCountFunc;
+  
+  // Declares the logging hook Name. With PreserveMost the site calls the
+  // runtime's preserve_most shim of the hook instead. With PrivateMemory
+  // the hook is known to touch only runtime state and the strings it is
+  // passed, so code around the sites is optimised as if it were not there.
+  static FunctionCallee getLogHook(Module &M, StringRef Name,
+                                   FunctionType *Ty, bool PreserveMost,
+                                   bool PrivateMemory) {
+    FunctionCallee Hook = getRuntimeHook(
+        M, PreserveMost ? (Name + "_pm").str() : Name.str(), Ty);
+    auto *Fn = dyn_cast<Function>(Hook.getCallee());
+    if (!Fn)
+      return Hook;
+    if (PreserveMost)
+      Fn->setCallingConv(CallingConv::PreserveMost);
+    if (PrivateMemory) {
+      Fn->addFnAttr(Attribute::InaccessibleMemOrArgMemOnly);
+      for (Argument &Arg : Fn->args()) {
+        if (!Arg.getType()->isPointerTy())
+          continue;
+        Arg.addAttr(Attribute::ReadOnly);
+        Arg.addAttr(Attribute::NoCapture);
+      }
+    }
+    return Hook;
+  }
+  
+  // Outlined stubs by hook and API name, per module
+  DenseMap<std::pair<Value*, Constant*>, Function*> ColdStubs;
+  
+  // The stub that calls Hook with APIName prepended to its own arguments.
+  // It keeps the hook's convention and attributes, is never inlined, is
+  // cold and goes to .text.unlikely, away from the sites. Only reports
+  // that run a fraction of the time their site does go through stubs.
+  Function *getColdStub(FunctionCallee Hook, Constant *APIName) {
+    Function *&Stub = ColdStubs[{Hook.getCallee(), APIName}];
+    if (Stub)
+      return Stub;
+    
+    auto *HookFn = cast<Function>(Hook.getCallee());
+    FunctionType *HookTy = Hook.getFunctionType();
+    Stub = Function::Create(
+        FunctionType::get(HookTy->getReturnType(),
+                          HookTy->params().drop_front(), false),
+        GlobalValue::PrivateLinkage, "dangerous_api.stub",
+        HookFn->getParent());
+    Stub->setCallingConv(HookFn->getCallingConv());
+    AttributeList Attrs = HookFn->getAttributes();
+    for (Attribute Attr : Attrs.getFnAttrs())
+      Stub->addFnAttr(Attr);
+    for (unsigned I = 1; I < HookTy->getNumParams(); ++I)
+      for (Attribute Attr : Attrs.getParamAttrs(I))
+        Stub->addParamAttr(I - 1, Attr);
+    Stub->addFnAttr(Attribute::NoInline);
+    Stub->addFnAttr(Attribute::Cold);
+    Stub->addFnAttr(Attribute::OptimizeForSize);
+    Stub->addFnAttr(Attribute::MinSize);
+    Stub->setSectionPrefix("unlikely");
+    
+    IRBuilder<> Builder(BasicBlock::Create(Stub->getContext(), "", Stub));
+    SmallVector<Value*, 4> Args = {APIName};
+    for (Argument &Arg : Stub->args())
+      Args.push_back(&Arg);
+    CallInst *Call = Builder.CreateCall(Hook, Args);
+    Call->setCallingConv(HookFn->getCallingConv());
+    Call->setTailCall();
+    Builder.CreateRetVoid();
+    return Stub;
+  }
+  
+  // Calls a logging hook in the convention it was declared with. Rare
+  // calls, those behind an inline fast path, go through the hook's stub
+  // for the API with -dangerous-api-outline; sites that report at every
+  // execution keep the direct call.
+  CallInst *callLogHook(IRBuilder<> &Builder, FunctionCallee Hook,
+                        ArrayRef<Value*> Args, bool Rare = false) {
+    if (Rare && ClOutline && isa<Function>(Hook.getCallee()))
+      if (auto *APIName = dyn_cast<Constant>(Args.front())) {
+        Hook = getColdStub(Hook, APIName);
+        Args = Args.drop_front();
+      }
+    CallInst *Call = Builder.CreateCall(Hook, Args);
+    if (auto *Fn = dyn_cast<Function>(Hook.getCallee()))
+      Call->setCallingConv(Fn->getCallingConv());
+    return Call;
+  }
+  
+  // Loads the catalog from -dangerous-api-catalog, or the built-in list
+  bool loadCatalog(LLVMContext &Ctx) {
+    if (CatalogLoaded) return true;
+    
+    if (ClCatalogFile.empty()) {
+      for (const char *Name : DefaultCatalog)
+        Catalog.insert(Name);
+      CatalogLoaded = true;
+      return true;
+    }
+    
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+        MemoryBuffer::getFile(ClCatalogFile);
+    if (!Buffer) {
+      Ctx.emitError("dangerous-api-pass: cannot read catalog '" +
+                    ClCatalogFile + "': " + Buffer.getError().message());
+      return false;
+    }
+    
+    SmallVector<StringRef, 64> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n');
+    for (StringRef Line : Lines) {
+      Line = Line.split('#').first.trim();
+      if (!Line.empty())
+        Catalog.insert(Line);
+    }
+    CatalogLoaded = true;
+    return true;
+  }
+  
+  // Decides whether a declaration is (a variant of) a catalog entry.
+  // LibFuncs are matched by enum, which also checks the prototype and
+  // honours the target's availability and custom names; everything else
+  // falls back to the name, with the __X_chk and __isoc99_X / __isoc23_X
+  // spellings mapped back to X.
+  Optional<APIInfo> classifyAPI(const Function &F,
+                                const TargetLibraryInfo &TLI) {
+    if (CatalogFuncs.empty()) {
+      CatalogFuncs.resize(NumLibFuncs);
+      for (const auto &Entry : Catalog) {
+        LibFunc LF;
+        if (TLI.getLibFunc(Entry.getKey(), LF))
+          CatalogFuncs.set(LF);
+      }
+    }
+    
+    LibFunc LF;
+    if (TLI.getLibFunc(F, LF) && TLI.has(LF)) {
+      bool Fortified = false;
+      if (!CatalogFuncs.test(LF)) {
+        for (const LibFuncAlias &Alias : LibFuncAliases) {
+          if (Alias.Variant == LF) {
+            LF = Alias.Base;
+            Fortified = Alias.Fortified;
+            break;
+          }
+        }
+      }
+      if (CatalogFuncs.test(LF))
+        return APIInfo{TLI.getName(LF), Fortified};
+      return None;
+    }
+    
+    StringRef Name = F.getName();
+    bool Fortified = false;
+    if (Name.startswith("__") && Name.endswith("_chk") && !Catalog.count(Name)) {
+      Name = Name.drop_front(2).drop_back(4);
+      Fortified = true;
+    } else if (!Name.consume_front("__isoc99_")) {
+      Name.consume_front("__isoc23_");
+    }
+    auto It = Catalog.find(Name);
+    if (It == Catalog.end())
+      return None;
+    return APIInfo{It->getKey(), Fortified};
+  }
+  
+  // The memory intrinsics -dangerous-api-mem-intrinsics instruments, under
+  // their unmangled names
+  static Optional<APIInfo> classifyMemIntrinsic(const Function &F) {
+    switch (F.getIntrinsicID()) {
+    case Intrinsic::memcpy:
+      return APIInfo{"llvm.memcpy", false};
+    case Intrinsic::memmove:
+      return APIInfo{"llvm.memmove", false};
+    case Intrinsic::memset:
+      return APIInfo{"llvm.memset", false};
+    default:
+      return None;
+    }
+  }
+  
+  // Calls the runtime for one execution of a site. Copy-family APIs go
+  // through the size-aware hooks instead of profiling_log.
+  void emitSiteHook(IRBuilder<> &Builder, CallBase *CB, const APIInfo &Info,
+                    Value *APIName, Value *CallerName, bool Rare = false) {
+    const CopySizeSpec *Spec = findCopySizeSpec(Info.Name);
+    if (Spec && Spec->SizeArg >= 0 &&
+        (unsigned)Spec->SizeArg < CB->arg_size() &&
+        CB->getArgOperand(Spec->SizeArg)->getType()->isIntegerTy()) {
+      Value *Size = Builder.CreateZExtOrTrunc(CB->getArgOperand(Spec->SizeArg),
+                                              Builder.getInt64Ty());
+      callLogHook(Builder, LogSizeFunc, {APIName, CallerName, Size}, Rare);
+    } else if (Spec && Spec->SrcArg >= 0 &&
+               (unsigned)Spec->SrcArg < CB->arg_size() &&
+               CB->getArgOperand(Spec->SrcArg)->getType()->isPointerTy()) {
+      callLogHook(Builder, LogStrFunc,
+                  {APIName, CallerName, CB->getArgOperand(Spec->SrcArg)},
+                  Rare);
+    } else {
+      callLogHook(Builder, LogFunc, {APIName, CallerName}, Rare);
+    }
+  }
+  
+  // Name a site is reported under; intrinsics lose their type mangling
+  static StringRef siteAPIName(CallBase *CB, const APIInfo &Info) {
+    Function *Callee = CB->getCalledFunction();
+    return Callee->isIntrinsic() ? Info.Name : Callee->getName();
+  }
+  
+  // Counter promotion (-dangerous-api-counting=promote). A site that runs
+  // exactly once per iteration of a loop whose trip count SCEV can compute
+  // adds the trip count once at the loop exit. Any other site in a loop
+  // with dedicated exits counts into a local that mem2reg keeps in a
+  // register, flushed at every exit; sites of the same API in one loop
+  // share that local. Exits through exit()/longjmp lose the counts of the
+  // loop instance in flight. Returns the sites left for per-call hooks.
+  std::vector<CallBase*>
+  promoteLoopCounters(Function &F, ArrayRef<CallBase*> Sites,
+                      const DenseMap<const Function*, APIInfo> &APIs,
+                      FunctionAnalysisManager &FAM,
+                      OptimizationRemarkEmitter &ORE, StringPool &Strings) {
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(),
+                          "dangerous_api.tc");
+    Type *Int64Ty = Type::getInt64Ty(F.getContext());
+    
+    // Promotion wants preheaders and dedicated exits, and LoopSimplify need
+    // not have run before us
+    SmallPtrSet<Loop*, 4> Simplified;
+    for (CallBase *CB : Sites) {
+      Loop *L = LI.getLoopFor(CB->getParent());
+      if (!L)
+        continue;
+      while (L->getParentLoop())
+        L = L->getParentLoop();
+      if (Simplified.insert(L).second)
+        simplifyLoop(L, &DT, &LI, &SE, nullptr, nullptr, false);
+    }
+    
+    std::vector<CallBase*> Remaining;
+    std::vector<AllocaInst*> Counters;
+    DenseMap<std::pair<Loop*, Value*>, AllocaInst*> CounterFor;
+    for (CallBase *CB : Sites) {
+      Loop *L = LI.getLoopFor(CB->getParent());
+      SmallVector<BasicBlock*, 4> Exits;
+      if (L && L->hasDedicatedExits())
+        L->getExitBlocks(Exits);
+      // Flushes go after the landingpad of EH exits; other pads cannot
+      // hold them
+      if (Exits.empty() || any_of(Exits, [](BasicBlock *BB) {
+            return BB->isEHPad() && !BB->isLandingPad();
+          })) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      
+      StringRef API = siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+      Value *APIName = Strings.get(API);
+      Value *CallerName = Strings.get(F.getName());
+      
+      BasicBlock *Preheader = L->getLoopPreheader();
+      BasicBlock *Latch = L->getLoopLatch();
+      if (Preheader && Latch && L->getExitingBlock() == Latch &&
+          DT.dominates(CB->getParent(), Latch)) {
+        // Wider trip counts would not fit the runtime's 64-bit count
+        const SCEV *BTC = SE.getBackedgeTakenCount(L);
+        if (!isa<SCEVCouldNotCompute>(BTC) &&
+            SE.getTypeSizeInBits(BTC->getType()) <= 64) {
+          const SCEV *TC = SE.getAddExpr(SE.getZeroExtendExpr(BTC, Int64Ty),
+                                         SE.getOne(Int64Ty));
+          Instruction *InsertPt = Preheader->getTerminator();
+          if (isSafeToExpandAt(TC, InsertPt, SE)) {
+            Value *Count = Expander.expandCodeFor(TC, Int64Ty, InsertPt);
+            for (BasicBlock *Exit : Exits) {
+              IRBuilder<> Builder(&*Exit->getFirstInsertionPt());
+              callLogHook(Builder, LogCountFunc, {APIName, CallerName, Count});
+            }
+            ++NumTripCountSites;
+            ORE.emit([&]() {
+              return OptimizationRemark(DEBUG_TYPE, "PromotedTripCount", CB)
+                     << "counted call to " << ore::NV("API", API)
+                     << " from the trip count of its loop";
+            });
+            continue;
+          }
+        }
+      }
+      
+      AllocaInst *&Counter = CounterFor[{L, APIName}];
+      if (!Counter) {
+        IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+        Counter = EntryBuilder.CreateAlloca(Int64Ty, nullptr,
+                                            "dangerous_api.count");
+        EntryBuilder.CreateStore(ConstantInt::get(Int64Ty, 0), Counter);
+        for (BasicBlock *Exit : Exits) {
+          IRBuilder<> Builder(&*Exit->getFirstInsertionPt());
+          callLogHook(Builder, LogCountFunc,
+                      {APIName, CallerName,
+                       Builder.CreateLoad(Int64Ty, Counter)});
+          Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Counter);
+        }
+        Counters.push_back(Counter);
+      }
+      IRBuilder<> Builder(CB);
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Counter),
+                            ConstantInt::get(Int64Ty, 1)),
+          Counter);
+      ++NumRegisterSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "PromotedRegister", CB)
+               << "counted call to " << ore::NV("API", API)
+               << " in a register flushed at its loop exits";
+      });
+    }
+    
+    if (!Counters.empty())
+      PromoteMemToReg(Counters, DT);
+    return Remaining;
+  }
+  
+  // Whether a counter can go on the CFG edge Src -> Dst: in Src before its
+  // terminator, at the top of Dst, or in a block splitting the edge
+  static bool canPlaceEdgeCounter(BasicBlock *Src, BasicBlock *Dst) {
+    Instruction *Term = Src->getTerminator();
+    if (Src->getUniqueSuccessor() == Dst && !Term->isEHPad())
+      return true;
+    if (Dst->getUniquePredecessor() == Src)
+      return Dst->getFirstInsertionPt() != Dst->end();
+    return !Dst->isEHPad() && !isa<IndirectBrInst>(Term) &&
+           !isa<CallBrInst>(Term);
+  }
+  
+  // Whether a call that unwinds, longjmps or exits can leave BB before
+  // its terminator
+  static bool mayLeaveMidBlock(BasicBlock *BB, Instruction *End) {
+    for (Instruction &I : make_range(BB->begin(), End->getIterator()))
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+        return true;
+    return false;
+  }
+  
+  // Dst is null for the edge from a returning block to the virtual exit.
+  // That one is counted on entry to Src, so blocks that end in a throw or
+  // a noreturn call still balance. Src is null for the edge from the
+  // virtual exit to the entry, counted on entry to the function.
+  static Instruction *edgeCounterInsertPoint(Function &F, BasicBlock *Src,
+                                             BasicBlock *Dst) {
+    if (!Src)
+      return &*F.getEntryBlock().getFirstInsertionPt();
+    if (!Dst)
+      return &*Src->getFirstInsertionPt();
+    Instruction *Term = Src->getTerminator();
+    if (Src->getUniqueSuccessor() == Dst && !Term->isEHPad())
+      return Term;
+    if (Dst->getUniquePredecessor() == Src)
+      return &*Dst->getFirstInsertionPt();
+    BasicBlock *Split = SplitCriticalEdge(
+        Term, GetSuccessorNumber(Src, Dst),
+        CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+    assert(Split && "edge counter placement checked up front");
+    return Split->getTerminator();
+  }
+  
+  // Knuth's optimal counter placement, as gcov does it. With a virtual
+  // edge from the exit back to the entry every block conserves flow, so
+  // the counts on the edges off any spanning tree of the CFG determine the
+  // others. Counters go on the non-tree edges only; edges deep in loops
+  // are taken into the tree first so the counters avoid the hottest ones,
+  // and edges that cannot carry a counter before everything else. If such
+  // an edge is still left out, the function keeps its per-call hooks. The
+  // runtime solves for the tree edges when the profile is written and
+  // credits each site with the count of its block. A block a call can
+  // leave mid-way does not conserve flow through its terminator alone, so,
+  // like gcov, it gets an uncounted edge to the exit for those departures,
+  // and a site after such a call is split into a block of its own.
+  // Returns the sites left for per-call hooks.
+  std::vector<CallBase*>
+  instrumentSpanningTree(Function &F, ArrayRef<CallBase*> Sites,
+                         const DenseMap<const Function*, APIInfo> &APIs,
+                         FunctionAnalysisManager &FAM, CounterModule &CM,
+                         OptimizationRemarkEmitter &ORE,
+                         StringPool &Strings) {
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    
+    for (CallBase *CB : Sites)
+      if (mayLeaveMidBlock(CB->getParent(), CB))
+        SplitBlock(CB->getParent(), CB, &DT, &LI);
+    
+    // Nodes are the reachable blocks and then the virtual exit
+    DenseMap<BasicBlock*, unsigned> NodeOf;
+    std::vector<BasicBlock*> Blocks;
+    for (BasicBlock *BB : depth_first(&F.getEntryBlock())) {
+      NodeOf[BB] = Blocks.size();
+      Blocks.push_back(BB);
+    }
+    unsigned ExitNode = Blocks.size();
+    
+    struct CFGEdge {
+      unsigned Src, Dst;
+      unsigned Weight;
+      bool InTree;
+    };
+    const unsigned MustTree = ~0u;
+    std::vector<CFGEdge> Edges;
+    Edges.push_back({ExitNode, 0, MustTree - 1, false});
+    for (BasicBlock *BB : Blocks) {
+      if (succ_empty(BB)) {
+        Edges.push_back({NodeOf[BB], ExitNode, LI.getLoopDepth(BB), false});
+        continue;
+      }
+      if (mayLeaveMidBlock(BB, BB->getTerminator()))
+        Edges.push_back({NodeOf[BB], ExitNode, MustTree, false});
+      SmallPtrSet<BasicBlock*, 4> Seen;
+      for (BasicBlock *Succ : successors(BB)) {
+        if (!Seen.insert(Succ).second)
+          continue;
+        // Back edges run on every iteration of their loop
+        Loop *L = LI.getLoopFor(Succ);
+        bool BackEdge = L && L->getHeader() == Succ && L->contains(BB);
+        unsigned Weight =
+            canPlaceEdgeCounter(BB, Succ)
+                ? 2 * (LI.getLoopDepth(BB) + LI.getLoopDepth(Succ)) + BackEdge
+                : MustTree;
+        Edges.push_back({NodeOf[BB], NodeOf[Succ], Weight, false});
+      }
+    }
+    
+    // Kruskal, heaviest edges first
+    std::stable_sort(Edges.begin(), Edges.end(),
+                     [](const CFGEdge &A, const CFGEdge &B) {
+                       return A.Weight > B.Weight;
+                     });
+    std::vector<unsigned> Parent(ExitNode + 1);
+    for (unsigned I = 0; I <= ExitNode; ++I)
+      Parent[I] = I;
+    auto Find = [&](unsigned X) {
+      while (Parent[X] != X)
+        X = Parent[X] = Parent[Parent[X]];
+      return X;
+    };
+    for (CFGEdge &E : Edges) {
+      unsigned A = Find(E.Src), B = Find(E.Dst);
+      if (A != B) {
+        Parent[A] = B;
+        E.InTree = true;
+      }
+    }
+    if (any_of(Edges, [&](const CFGEdge &E) {
+          return !E.InTree && E.Weight == MustTree;
+        }))
+      return std::vector<CallBase*>(Sites.begin(), Sites.end());
+    
+    // Sites in unreachable blocks have no node and keep their hooks
+    std::vector<CallBase*> Remaining;
+    std::vector<Constant*> SiteTable;
+    for (CallBase *CB : Sites) {
+      auto It = NodeOf.find(CB->getParent());
+      if (It == NodeOf.end()) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      StringRef API = siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+      SiteTable.push_back(CM.site(Strings.get(API), It->second));
+      ++NumEdgeProfiledSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "EdgeProfiled", CB)
+               << "counted call to " << ore::NV("API", API)
+               << " from the edge profile of its function";
+      });
+    }
+    
+    std::vector<Constant*> EdgeTable;
+    for (const CFGEdge &E : Edges) {
+      int Counter = -1;
+      if (!E.InTree) {
+        Counter = CM.allocateCounter();
+        IRBuilder<> Builder(edgeCounterInsertPoint(
+            F, E.Src == ExitNode ? nullptr : Blocks[E.Src],
+            E.Dst == ExitNode ? nullptr : Blocks[E.Dst]));
+        CM.emitIncrement(Builder, Counter);
+        ++NumEdgeCounters;
+      }
+      EdgeTable.push_back(CM.edge(E.Src, E.Dst, Counter));
+    }
+    CM.addFunction(Strings.get(F.getName()), ExitNode + 1, EdgeTable,
+                   SiteTable);
+    return Remaining;
+  }
+  
+  // A copy is provably in bounds when it writes a constant number of bytes,
+  // the length of a constant source string plus its terminator or a
+  // constant size operand, into a known object with at least that many
+  // bytes left: the reasoning behind __builtin_object_size. Such sites stay
+  // uninstrumented and are only listed in the module's elided table.
+  // Returns the sites still to instrument.
+  std::vector<CallBase*>
+  elideBoundedSites(Function &F, ArrayRef<CallBase*> Sites,
+                    const DenseMap<const Function*, APIInfo> &APIs,
+                    FunctionAnalysisManager &FAM, CounterModule &CM,
+                    OptimizationRemarkEmitter &ORE, StringPool &Strings) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    const TargetLibraryInfo &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+    
+    std::vector<CallBase*> Remaining;
+    for (CallBase *CB : Sites) {
+      APIInfo Info = APIs.lookup(CB->getCalledFunction());
+      const CopySizeSpec *Spec = findCopySizeSpec(Info.Name);
+      if (!Spec || Spec->DstArg < 0 ||
+          (unsigned)Spec->DstArg >= CB->arg_size()) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      
+      Optional<uint64_t> Bytes;
+      StringRef Str;
+      if (Spec->SrcArg >= 0 && (unsigned)Spec->SrcArg < CB->arg_size() &&
+          getConstantStringInfo(CB->getArgOperand(Spec->SrcArg), Str))
+        Bytes = Str.size() + 1;
+      else if (Spec->SizeArg >= 0 && (unsigned)Spec->SizeArg < CB->arg_size())
+        if (auto *Size = dyn_cast<ConstantInt>(CB->getArgOperand(Spec->SizeArg)))
+          Bytes = Size->getLimitedValue();
+      uint64_t ObjectBytes;
+      if (!Bytes ||
+          !getObjectSize(CB->getArgOperand(Spec->DstArg), ObjectBytes, DL,
+                         &TLI) ||
+          *Bytes > ObjectBytes) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      
+      StringRef API = siteAPIName(CB, Info);
+      CM.addElided(Strings.get(API), Strings.get(F.getName()), *Bytes,
+                   ObjectBytes);
+      ++NumElidedSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Elided", CB)
+               << "left call to " << ore::NV("API", API)
+               << " uninstrumented: it copies " << ore::NV("Bytes", *Bytes)
+               << " bytes into an object with "
+               << ore::NV("ObjectBytes", ObjectBytes) << " bytes left";
+      });
+    }
+    return Remaining;
+  }
+  
+  // Instrumentation density from an existing PGO profile. Cold sites, and
+  // sites the profile has no count for, keep the full per-call hook with
+  // sizes and timestamps. Warm sites only bump an inline counter that the
+  // runtime reads at exit. Hot sites bump one too but also report to the
+  // runtime every Period-th execution, a power of two chosen at compile
+  // time so the site makes about -dangerous-api-hot-samples calls over a
+  // run like the profiled one; the runtime adds the remainder at exit.
+  // Returns the sites left for per-call hooks.
+  std::vector<CallBase*>
+  applyProfileDensity(Function &F, ArrayRef<CallBase*> Sites,
+                      const DenseMap<const Function*, APIInfo> &APIs,
+                      FunctionAnalysisManager &FAM, ProfileSummaryInfo &PSI,
+                      CounterModule &CM, OptimizationRemarkEmitter &ORE,
+                      StringPool &Strings) {
+    BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    
+    std::vector<CallBase*> Remaining;
+    std::vector<Constant*> SiteTable, GroupTable;
+    for (CallBase *CB : Sites) {
+      BasicBlock *BB = CB->getParent();
+      Optional<uint64_t> Count = BFI.getBlockProfileCount(BB);
+      if (!Count || PSI.isColdBlock(BB, &BFI)) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      
+      StringRef API = siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+      Constant *APIName = Strings.get(API);
+      bool Hot = PSI.isHotBlock(BB, &BFI);
+      uint64_t Period = 0;
+      if (Hot)
+        Period = std::min<uint64_t>(
+            PowerOf2Ceil(std::max<uint64_t>(
+                *Count / std::max(ClHotSamples.getValue(), 1u), 2)),
+            1u << 30);
+      
+      unsigned Counter = CM.allocateCounter();
+      IRBuilder<> Builder(CB);
+      Value *Old = CM.emitIncrement(Builder, Counter);
+      if (Hot) {
+        Value *Due = Builder.CreateICmpEQ(
+            Builder.CreateAnd(Old, Period - 1),
+            ConstantInt::get(Old->getType(), Period - 1));
+        Instruction *Report = SplitBlockAndInsertIfThen(
+            Due, CB, /*Unreachable=*/false,
+            MDBuilder(CB->getContext()).createBranchWeights(1, Period - 1));
+        IRBuilder<> ReportBuilder(Report);
+        callLogHook(ReportBuilder, LogCountFunc,
+                    {APIName, Strings.get(F.getName()),
+                     ReportBuilder.getInt64(Period)},
+                    /*Rare=*/true);
+        ++NumHotSites;
+      } else {
+        ++NumWarmSites;
+      }
+      GroupTable.push_back(CM.group(Counter, SiteTable.size(), 1, Period));
+      SiteTable.push_back(CM.site(APIName, -1));
+      
+      ORE.emit([&]() {
+        OptimizationRemark R(DEBUG_TYPE, "ProfileGuided", CB);
+        R << "counted " << (Hot ? "hot" : "warm") << " call to "
+          << ore::NV("API", API) << " (" << ore::NV("ProfileCount", *Count)
+          << " in the profile) with an inline counter";
+        if (Hot)
+          R << ", reporting every " << ore::NV("Period", Period)
+            << " executions";
+        return R;
+      });
+    }
+    if (!GroupTable.empty())
+      CM.addFunction(Strings.get(F.getName()), 0, {}, SiteTable, GroupTable);
+    return Remaining;
+  }
+  
+  // -dangerous-api-counting=estimate: each site is credited with the
+  // profile count of its block, and the totals per (API, caller) are
+  // written at compile time in the layout of dangerous_api_profile.json.
+  // Sites in functions the profile does not cover are only counted in the
+  // summary.
+  static void writeProfileEstimate(
+      Module &M, const MapVector<Function*, std::vector<CallBase*>> &Sites,
+      const DenseMap<const Function*, APIInfo> &APIs,
+      FunctionAnalysisManager &FAM) {
+    struct Estimate {
+      StringRef API;
+      StringRef Caller;
+      bool Fortified;
+      uint64_t Count;
+    };
+    std::vector<Estimate> Estimates;
+    DenseMap<std::pair<StringRef, StringRef>, size_t> IndexOf;
+    uint64_t Total = 0;
+    unsigned Unprofiled = 0;
+    for (auto &Entry : Sites) {
+      Function &F = *Entry.first;
+      BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+      for (CallBase *CB : Entry.second) {
+        Optional<uint64_t> Count = BFI.getBlockProfileCount(CB->getParent());
+        if (!Count) {
+          ++Unprofiled;
+          continue;
+        }
+        if (*Count == 0)
+          continue;
+        APIInfo Info = APIs.lookup(CB->getCalledFunction());
+        StringRef API = siteAPIName(CB, Info);
+        auto Inserted = IndexOf.try_emplace({API, F.getName()},
+                                            Estimates.size());
+        if (Inserted.second)
+          Estimates.push_back({API, F.getName(), Info.Fortified, 0});
+        Estimates[Inserted.first->second].Count += *Count;
+        Total += *Count;
+      }
+    }
+    
+    std::string Path = ClEstimateOutput;
+    if (Path.empty())
+      Path = M.getSourceFileName() + ".dangerous_api_profile.json";
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC);
+    if (EC) {
+      M.getContext().emitError("dangerous-api-pass: cannot write '" + Path +
+                               "': " + EC.message());
+      return;
+    }
+    
+    json::OStream J(OS, 2);
+    J.object([&] {
+      J.attributeArray("profile_data", [&] {
+        for (const Estimate &E : Estimates) {
+          J.object([&] {
+            J.attribute("api_name", E.API);
+            J.attribute("caller_function", E.Caller);
+            J.attribute("fortified", E.Fortified);
+            J.attribute("execution_count", int64_t(E.Count));
+            // Two decimals, like the runtime
+            J.attributeBegin("percentage_of_total");
+            J.rawValue([&](raw_ostream &OS) {
+              OS << format("%.2f", E.Count * 100.0 / Total);
+            });
+            J.attributeEnd();
+          });
+        }
+      });
+      J.attributeObject("summary", [&] {
+        J.attribute("total_dangerous_calls", int64_t(Total));
+        J.attribute("estimated_from_profile", true);
+        J.attribute("unprofiled_sites", Unprofiled);
+        J.attribute("unique_call_sites", int64_t(Estimates.size()));
+      });
+    });
+    OS << "\n";
+  }
+  
+  // XRay-style sleds (-dangerous-api-counting=sleds). Each site gets an
+  // 11-byte no-op, "jmp .+11" over a 9-byte nop, which the runtime can
+  // patch while the program runs into
+  //   mov $id, %r10d; call __dangerous_api_sled_trampoline
+  // and back. The jump keeps the tail dead while it is rewritten, so
+  // switching only needs an atomic store of the first two bytes, which
+  // the alignment keeps within one cache line. Every sled is recorded in
+  // the dapi_sleds section with its address and names, and the runtime
+  // numbers the records. The trampoline preserves every register but
+  // r10 and the flags; the call it makes pushes below the stack pointer,
+  // so functions with sleds give up their red zone. Returns the sites left
+  // for per-call hooks, which is all of them off x86-64.
+  std::vector<CallBase*> emitSleds(Function &F, ArrayRef<CallBase*> Sites,
+                                   const DenseMap<const Function*, APIInfo> &APIs,
+                                   OptimizationRemarkEmitter &ORE,
+                                   StringPool &Strings) {
+    if (Triple(F.getParent()->getTargetTriple()).getArch() != Triple::x86_64)
+      return std::vector<CallBase*>(Sites.begin(), Sites.end());
+    
+    LLVMContext &Ctx = F.getContext();
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+    InlineAsm *Sled = InlineAsm::get(
+        FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy}, false),
+        ".p2align 1, 0x90\n"
+        ".Ldapi_sled${:uid}:\n"
+        ".byte 0xeb, 0x09, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, "
+        "0x00\n"
+        ".pushsection dapi_sleds,\"aw\",@progbits\n"
+        ".p2align 3\n"
+        ".quad .Ldapi_sled${:uid}\n"
+        ".quad ${0:c}\n"
+        ".quad ${1:c}\n"
+        ".popsection",
+        "i,i,~{r10},~{dirflag},~{fpsr},~{flags}", /*hasSideEffects=*/true);
+    
+    for (CallBase *CB : Sites) {
+      StringRef API = siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+      IRBuilder<> Builder(CB);
+      Builder.CreateCall(Sled, {Strings.get(API), Strings.get(F.getName())});
+      ++NumSleds;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Sled", CB)
+               << "emitted a patchable sled for call to "
+               << ore::NV("API", API);
+      });
+    }
+    F.addFnAttr(Attribute::NoRedZone);
+    return {};
+  }
+  
+  // Enable bytes (-dangerous-api-counting=gated). Each site gets a byte in
+  // the dapi_enable section, initially set, and its hook only runs while
+  // the byte is set; the branch around the hook is predicted not taken, so
+  // a site the runtime switched off costs one load of a cached byte. A
+  // record in dapi_gates ties the byte to the site's names for the runtime.
+  // The load is atomic since the runtime flips bytes from other threads,
+  // and keeps the check from being hoisted out of loops.
+  void emitGatedHooks(Function &F, ArrayRef<CallBase*> Sites,
+                      const DenseMap<const Function*, APIInfo> &APIs,
+                      OptimizationRemarkEmitter &ORE, StringPool &Strings) {
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+    StructType *RecordTy = StructType::get(PtrTy, PtrTy, PtrTy);
+    
+    for (CallBase *CB : Sites) {
+      APIInfo Info = APIs.lookup(CB->getCalledFunction());
+      StringRef API = siteAPIName(CB, Info);
+      Constant *APIName = Strings.get(API);
+      Constant *CallerName = Strings.get(F.getName());
+      
+      auto *Gate = new GlobalVariable(M, Int8Ty, /*isConstant=*/false,
+                                      GlobalValue::PrivateLinkage,
+                                      ConstantInt::get(Int8Ty, 1),
+                                      "__dangerous_api_gate");
+      Gate->setSection("dapi_enable");
+      auto *Record = new GlobalVariable(
+          M, RecordTy, /*isConstant=*/true, GlobalValue::PrivateLinkage,
+          ConstantStruct::get(RecordTy, {Gate, APIName, CallerName}),
+          "__dangerous_api_gate_record");
+      Record->setSection("dapi_gates");
+      Record->setAlignment(Align(8));
+      appendToCompilerUsed(M, {Record});
+      
+      IRBuilder<> Builder(CB);
+      LoadInst *Enabled = Builder.CreateLoad(Int8Ty, Gate, "dangerous_api.gate");
+      Enabled->setAtomic(AtomicOrdering::Monotonic);
+      Enabled->setAlignment(Align(1));
+      Instruction *Hook = SplitBlockAndInsertIfThen(
+          Builder.CreateIsNotNull(Enabled), CB, /*Unreachable=*/false,
+          MDBuilder(Ctx).createBranchWeights(100000, 1));
+      IRBuilder<> HookBuilder(Hook);
+      emitSiteHook(HookBuilder, CB, Info, APIName, CallerName);
+      
+      ++NumGatedSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Gated", CB)
+               << "instrumented call to " << ore::NV("API", API)
+               << " behind an enable byte";
+      });
+    }
+  }
+  
+  // Whether F can be split into a checking and a sampled copy: every block
+  // must be clonable and every back edge must be redirectable, and values
+  // of token type cannot be carried between the copies through memory.
+  static bool canDuplicateForSampling(Function &F) {
+    if (F.callsFunctionThatReturnsTwice())
+      return false;
+    for (BasicBlock &BB : F) {
+      Instruction *Term = BB.getTerminator();
+      if (BB.hasAddressTaken() || isa<IndirectBrInst>(Term) ||
+          isa<CallBrInst>(Term))
+        return false;
+      for (Instruction &I : BB)
+        if (I.getType()->isTokenTy())
+          return false;
+    }
+    SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> BackEdges;
+    FindFunctionBackedges(F, BackEdges);
+    return llvm::none_of(BackEdges, [](const auto &Edge) {
+      return Edge.second->isEHPad();
+    });
+  }
+  
+  // Decrements the thread's sampling countdown at the end of BB and
+  // branches to Sampled when it runs out, after rearming it from the
+  // runtime's interval, and to Checking otherwise.
+  static void emitSampleCheck(BasicBlock *BB, BasicBlock *Checking,
+                              BasicBlock *Sampled, GlobalVariable *Countdown,
+                              GlobalVariable *Interval) {
+    LLVMContext &Ctx = BB->getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    IRBuilder<> Builder(BB);
+    Value *Left = Builder.CreateSub(
+        Builder.CreateLoad(Int32Ty, Countdown, "dangerous_api.countdown"),
+        Builder.getInt32(1));
+    Builder.CreateStore(Left, Countdown);
+    BasicBlock *Rearm =
+        BasicBlock::Create(Ctx, "dangerous_api.sample", BB->getParent());
+    Builder.CreateCondBr(Builder.CreateICmpSLE(Left, Builder.getInt32(0)),
+                         Rearm, Checking,
+                         MDBuilder(Ctx).createBranchWeights(1, 100000));
+    
+    IRBuilder<> RearmBuilder(Rearm);
+    RearmBuilder.CreateStore(RearmBuilder.CreateLoad(Int32Ty, Interval),
+                             Countdown);
+    RearmBuilder.CreateBr(Sampled);
+  }
+  
+  // Arnold-Ryder sampling by code duplication
+  // (-dangerous-api-counting=sampling). The body of F is cloned; the
+  // original stays uninstrumented and becomes the checking code, and the
+  // clone gets the per-call hooks. The entry and every back edge of the
+  // checking code decrement a thread-local countdown and jump into the
+  // clone when it runs out. The back edges of the clone return through the
+  // same checks, so each sample follows one acyclic path and every path
+  // between two checks is sampled once per interval. Values cross
+  // between the copies through stack slots that mem2reg rebuilds into SSA
+  // afterwards. Every sampled hit stores the interval as its weight for the
+  // runtime first, which scales the counts back up. Returns the sites left
+  // for per-call hooks, which is all of them when F cannot be duplicated.
+  std::vector<CallBase*>
+  duplicateForSampling(Function &F, ArrayRef<CallBase*> Sites,
+                       const DenseMap<const Function*, APIInfo> &APIs,
+                       OptimizationRemarkEmitter &ORE, StringPool &Strings) {
+    if (!canDuplicateForSampling(F))
+      return std::vector<CallBase*>(Sites.begin(), Sites.end());
+    
+    // Countdown, interval and hit weight owned by the runtime
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *Countdown = dyn_cast<GlobalVariable>(
+        M.getOrInsertGlobal("__dangerous_api_sample_countdown", Int32Ty));
+    auto *Interval = dyn_cast<GlobalVariable>(
+        M.getOrInsertGlobal("__dangerous_api_sample_interval", Int32Ty));
+    auto *Weight = dyn_cast<GlobalVariable>(
+        M.getOrInsertGlobal("__dangerous_api_sample_weight", Int64Ty));
+    if (!Countdown || !Interval || !Weight)
+      return std::vector<CallBase*>(Sites.begin(), Sites.end());
+    Countdown->setThreadLocal(true);
+    Weight->setThreadLocal(true);
+    
+    // A fresh entry block keeps the static allocas and the entry check out
+    // of the cloned region
+    BasicBlock *OldEntry = &F.getEntryBlock();
+    BasicBlock *Entry =
+        BasicBlock::Create(Ctx, "dangerous_api.entry", &F, OldEntry);
+    Instruction *AllocaPoint = BranchInst::Create(OldEntry, Entry);
+    SmallVector<AllocaInst*, 8> StaticAllocas;
+    for (Instruction &I : *OldEntry)
+      if (auto *AI = dyn_cast<AllocaInst>(&I))
+        if (AI->isStaticAlloca())
+          StaticAllocas.push_back(AI);
+    for (AllocaInst *AI : StaticAllocas)
+      AI->moveBefore(AllocaPoint);
+    
+    // Demote the phis and then every value live across blocks, which
+    // includes the loads that replaced phis used outside their block
+    std::vector<AllocaInst*> Slots;
+    SmallVector<PHINode*, 16> Phis;
+    for (BasicBlock &BB : F)
+      if (&BB != Entry)
+        for (PHINode &PN : BB.phis())
+          Phis.push_back(&PN);
+    for (PHINode *PN : Phis)
+      Slots.push_back(DemotePHIToStack(PN, AllocaPoint));
+    SmallVector<Instruction*, 32> Live;
+    for (BasicBlock &BB : F) {
+      if (&BB == Entry)
+        continue;
+      for (Instruction &I : BB) {
+        if (I.getType()->isVoidTy())
+          continue;
+        if (llvm::any_of(I.users(), [&](const User *U) {
+              return cast<Instruction>(U)->getParent() != &BB;
+            }))
+          Live.push_back(&I);
+      }
+    }
+    for (Instruction *I : Live)
+      Slots.push_back(DemoteRegToStack(*I, false, AllocaPoint));
+    
+    SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> BackEdges;
+    FindFunctionBackedges(F, BackEdges);
+    
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock*, 32> Checking, Sampled;
+    for (BasicBlock &BB : F)
+      if (&BB != Entry)
+        Checking.push_back(&BB);
+    for (BasicBlock *BB : Checking) {
+      BasicBlock *Clone = CloneBasicBlock(BB, VMap, ".sampled", &F);
+      VMap[BB] = Clone;
+      Sampled.push_back(Clone);
+    }
+    remapInstructionsInBlocks(Sampled, VMap);
+    
+    // Checks at the entry and on the back edges of the checking code; the
+    // back edges of the clone lead back to the checking code and no longer
+    // close loops
+    AllocaPoint->eraseFromParent();
+    emitSampleCheck(Entry, OldEntry, cast<BasicBlock>(VMap[OldEntry]),
+                    Countdown, Interval);
+    for (auto &Edge : BackEdges) {
+      auto *From = const_cast<BasicBlock*>(Edge.first);
+      auto *To = const_cast<BasicBlock*>(Edge.second);
+      // Several successors of one terminator are a single back edge
+      if (!is_contained(successors(From), To))
+        continue;
+      auto *SampledFrom = cast<BasicBlock>(VMap[From]);
+      auto *SampledTo = cast<BasicBlock>(VMap[To]);
+      BasicBlock *Check = BasicBlock::Create(Ctx, "dangerous_api.backedge",
+                                             &F, To);
+      From->getTerminator()->replaceSuccessorWith(To, Check);
+      SampledFrom->getTerminator()->replaceSuccessorWith(SampledTo, Check);
+      SampledFrom->getTerminator()->setMetadata(LLVMContext::MD_loop, nullptr);
+      emitSampleCheck(Check, To, SampledTo, Countdown, Interval);
+    }
+    
+    for (CallBase *CB : Sites) {
+      APIInfo Info = APIs.lookup(CB->getCalledFunction());
+      StringRef API = siteAPIName(CB, Info);
+      auto *SampledCB = cast<CallBase>(VMap[CB]);
+      IRBuilder<> Builder(SampledCB);
+      Builder.CreateStore(
+          Builder.CreateZExt(Builder.CreateLoad(Int32Ty, Interval), Int64Ty),
+          Weight);
+      emitSiteHook(Builder, SampledCB, Info, Strings.get(API),
+                   Strings.get(F.getName()), /*Rare=*/true);
+      ++NumSampledSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Sampled", CB)
+               << "instrumented call to " << ore::NV("API", API)
+               << " in the sampled copy of " << ore::NV("Caller", F.getName());
+      });
+    }
+    
+    DominatorTree DT(F);
+    PromoteMemToReg(Slots, DT);
+    ++NumSampledFunctions;
+    return {};
+  }
+  
+  // Whether blocks A and B, where A dominates B, run equally often: both
+  // sit in the same innermost loop, so each runs at most once per
+  // iteration, and no path from A leaves the iteration (through a back
+  // edge, a loop exit or a return) without passing B. Exceptional exits
+  // are ignored, as everywhere else in the counting modes.
+  static bool isControlEquivalent(BasicBlock *A, BasicBlock *B,
+                                  LoopInfo &LI) {
+    Loop *L = LI.getLoopFor(A);
+    if (LI.getLoopFor(B) != L)
+      return false;
+    SmallVector<BasicBlock*, 8> Worklist = {A};
+    SmallPtrSet<BasicBlock*, 16> Visited = {A};
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      if (succ_empty(BB))
+        return false;
+      for (BasicBlock *Succ : successors(BB)) {
+        if (Succ == B)
+          continue;
+        if (L && (Succ == L->getHeader() || !L->contains(Succ)))
+          return false;
+        if (Visited.insert(Succ).second)
+          Worklist.push_back(Succ);
+      }
+    }
+    return true;
+  }
+  
+  // Sites in control-equivalent blocks always run together, so a single
+  // counter, bumped in the group's dominating block right before its first
+  // site, stands for all of them. The function's descriptor lists each
+  // group with its sites and the runtime expands the counts when the
+  // profile is written. Returns the sites left for per-call hooks.
+  std::vector<CallBase*>
+  instrumentSiteGroups(Function &F, ArrayRef<CallBase*> Sites,
+                       const DenseMap<const Function*, APIInfo> &APIs,
+                       FunctionAnalysisManager &FAM, CounterModule &CM,
+                       OptimizationRemarkEmitter &ORE, StringPool &Strings) {
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    
+    std::vector<CallBase*> Remaining;
+    SmallPtrSet<CallBase*, 8> SiteSet;
+    SmallPtrSet<BasicBlock*, 8> SiteBlocks;
+    for (CallBase *CB : Sites) {
+      if (!DT.isReachableFromEntry(CB->getParent())) {
+        Remaining.push_back(CB);
+        continue;
+      }
+      SiteSet.insert(CB);
+      SiteBlocks.insert(CB->getParent());
+    }
+    
+    // Dominator-tree preorder meets every group's leader first; the
+    // relation is transitive, so comparing against leaders is enough
+    MapVector<BasicBlock*, std::vector<CallBase*>> Groups;
+    for (DomTreeNode *Node : depth_first(DT.getRootNode())) {
+      BasicBlock *BB = Node->getBlock();
+      if (!SiteBlocks.count(BB))
+        continue;
+      BasicBlock *Leader = BB;
+      for (auto &Group : Groups) {
+        if (DT.dominates(Group.first, BB) &&
+            isControlEquivalent(Group.first, BB, LI)) {
+          Leader = Group.first;
+          break;
+        }
+      }
+      std::vector<CallBase*> &GroupSites = Groups[Leader];
+      for (Instruction &I : *BB)
+        if (auto *CB = dyn_cast<CallBase>(&I))
+          if (SiteSet.count(CB))
+            GroupSites.push_back(CB);
+    }
+    
+    std::vector<Constant*> SiteTable, GroupTable;
+    for (auto &Group : Groups) {
+      std::vector<CallBase*> &GroupSites = Group.second;
+      unsigned Counter = CM.allocateCounter();
+      IRBuilder<> Builder(GroupSites.front());
+      CM.emitIncrement(Builder, Counter);
+      GroupTable.push_back(
+          CM.group(Counter, SiteTable.size(), GroupSites.size()));
+      ++NumSiteGroups;
+      
+      for (CallBase *CB : GroupSites) {
+        StringRef API =
+            siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+        SiteTable.push_back(CM.site(Strings.get(API), -1));
+        ++NumGroupedSites;
+        ORE.emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "SharedCounter", CB)
+                 << "counted call to " << ore::NV("API", API)
+                 << " with a counter shared by "
+                 << ore::NV("GroupSize", (unsigned)GroupSites.size())
+                 << " control-equivalent sites";
+        });
+      }
+    }
+    if (!GroupTable.empty())
+      CM.addFunction(Strings.get(F.getName()), 0, {}, SiteTable, GroupTable);
+    return Remaining;
+  }
+  
+  // Per-invocation accumulation (-dangerous-api-counting=accumulate). The
+  // sites of each API count into a local that mem2reg keeps in a register,
+  // and every way out of the function adds the local to a shared counter
+  // once, skipping the atomic when it is zero. Unwinding is covered the way
+  // the CCT exit hooks cover it, through a cleanup pad that flushes and
+  // resumes. Calls that do not return, such as exit(), abort() and
+  // longjmp(), flush before they are made and clear the local, so one
+  // that throws adds nothing more in the cleanup pad. With
+  // -dangerous-api-cct the flushes call profiling_log_count instead, which
+  // credits the invocation's node of the tree; they still run before the
+  // exit hooks.
+  void accumulatePerInvocation(Function &F, ArrayRef<CallBase*> Sites,
+                               const DenseMap<const Function*, APIInfo> &APIs,
+                               CounterModule &CM,
+                               OptimizationRemarkEmitter &ORE,
+                               StringPool &Strings) {
+    Type *Int64Ty = Type::getInt64Ty(F.getContext());
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+    MapVector<Constant*, AllocaInst*> Locals;
+    for (CallBase *CB : Sites) {
+      StringRef API = siteAPIName(CB, APIs.lookup(CB->getCalledFunction()));
+      AllocaInst *&Local = Locals[Strings.get(API)];
+      if (!Local) {
+        Local = EntryBuilder.CreateAlloca(Int64Ty, nullptr,
+                                          "dangerous_api.count");
+        EntryBuilder.CreateStore(ConstantInt::get(Int64Ty, 0), Local);
+      }
+      IRBuilder<> Builder(CB);
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Local),
+                            ConstantInt::get(Int64Ty, 1)),
+          Local);
+      ++NumAccumulatedSites;
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Accumulated", CB)
+               << "counted call to " << ore::NV("API", API)
+               << " once per invocation of " << ore::NV("Caller", F.getName());
+      });
+    }
+    
+    std::vector<Constant*> SiteTable, GroupTable;
+    std::vector<unsigned> Shared;
+    if (!ClCallingContextTree) {
+      for (auto &Local : Locals) {
+        Shared.push_back(CM.allocateCounter());
+        GroupTable.push_back(CM.group(Shared.back(), SiteTable.size(), 1));
+        SiteTable.push_back(CM.site(Local.first, -1));
+      }
+      CM.addFunction(Strings.get(F.getName()), 0, {}, SiteTable, GroupTable);
+    }
+    
+    // The flushes split blocks, so the exits are collected before any is
+    // instrumented, lest the enumerator meet a return twice
+    SmallVector<Instruction*, 8> Exits;
+    EscapeEnumerator EE(F, "dangerous_api.cleanup",
+                        /*HandleExceptions=*/!F.doesNotThrow());
+    while (IRBuilder<> *Builder = EE.Next())
+      Exits.push_back(&*Builder->GetInsertPoint());
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        auto *CB = dyn_cast<CallBase>(&I);
+        if (!CB)
+          continue;
+        Instruction *Next = CB->getNextNode();
+        if (auto *II = dyn_cast<InvokeInst>(CB))
+          Next = II->getNormalDest()->getFirstNonPHI();
+        if (CB->doesNotReturn() || isa_and_nonnull<UnreachableInst>(Next))
+          Exits.push_back(CB);
+      }
+    }
+    for (Instruction *Exit : Exits) {
+      unsigned Counter = 0;
+      for (auto &Local : Locals) {
+        IRBuilder<> Builder(Exit);
+        Value *Count = Builder.CreateLoad(Int64Ty, Local.second);
+        Instruction *Flush = SplitBlockAndInsertIfThen(
+            Builder.CreateIsNotNull(Count), Exit, /*Unreachable=*/false);
+        IRBuilder<> FlushBuilder(Flush);
+        if (ClCallingContextTree)
+          callLogHook(FlushBuilder, LogCountFunc,
+                      {Local.first, Strings.get(F.getName()), Count});
+        else
+          CM.emitIncrement(FlushBuilder, Shared[Counter++], Count);
+        Builder.SetInsertPoint(Exit);
+        Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Local.second);
+      }
+    }
+    
+    std::vector<AllocaInst*> Promotable;
+    for (auto &Local : Locals)
+      Promotable.push_back(Local.second);
+    DominatorTree DT(F);
+    PromoteMemToReg(Promotable, DT);
+  }
+  
+  // Indirect calls test their target against the runtime's bitmap of
+  // dangerous function addresses inline, so the common miss costs a shift,
+  // a load and a predicted branch; only a hit calls profiling_log_indirect,
+  // which resolves the exact API.
+  static void instrumentIndirectCall(CallBase *CB, Function &F,
+                                     GlobalVariable *Filter,
+                                     FunctionCallee IndirectFunc,
+                                     StringPool &Strings) {
+    IRBuilder<> Builder(CB);
+    Type *IntPtrTy =
+        CB->getModule()->getDataLayout().getIntPtrType(CB->getContext());
+    Value *Target = CB->getCalledOperand();
+    Value *Bit = Builder.CreateAnd(
+        Builder.CreateLShr(Builder.CreatePtrToInt(Target, IntPtrTy),
+                           TargetFilterShift),
+        TargetFilterBits - 1);
+    Value *Byte = Builder.CreateLoad(
+        Builder.getInt8Ty(),
+        Builder.CreateInBoundsGEP(Builder.getInt8Ty(), Filter,
+                                  Builder.CreateLShr(Bit, 3)));
+    Value *Mask = Builder.CreateShl(
+        Builder.getInt8(1),
+        Builder.CreateTrunc(Builder.CreateAnd(Bit, 7), Builder.getInt8Ty()));
+    Value *Hit = Builder.CreateICmpNE(Builder.CreateAnd(Byte, Mask),
+                                      Builder.getInt8(0));
+    
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        Hit, CB, /*Unreachable=*/false,
+        MDBuilder(CB->getContext()).createBranchWeights(1, 100000));
+    IRBuilder<> ThenBuilder(Then);
+    ThenBuilder.CreateCall(IndirectFunc, {Target, Strings.get(F.getName())});
+  }
+  
+  // Registers the catalog functions whose address this module takes, so
+  // the runtime can recognise them as indirect call targets. Each entry is
+  // { void* address, const char* api_name }.
+  static void registerIndirectTargets(
+      Module &M, const DenseMap<const Function*, APIInfo> &APIs,
+      StringPool &Strings) {
+    LLVMContext &Ctx = M.getContext();
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+    StructType *EntryTy = StructType::get(PtrTy, PtrTy);
+    
+    std::vector<Constant*> Entries;
+    for (Function &API : M) {
+      if (!APIs.count(&API) || !API.hasAddressTaken()) continue;
+      Entries.push_back(
+          ConstantStruct::get(EntryTy, {&API, Strings.get(API.getName())}));
+    }
+    if (Entries.empty()) return;
+    
+    ArrayType *TableTy = ArrayType::get(EntryTy, Entries.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Entries),
+                                     "__dangerous_api_targets");
+    
+    // void profiling_register_targets(const void* table, int count)
+    FunctionCallee RegisterFunc = getRuntimeHook(
+        M, "profiling_register_targets",
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {PtrTy, Type::getInt32Ty(Ctx)}, false));
+    Function *Ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "dangerous_api.register_targets", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Ctor));
+    Builder.CreateCall(RegisterFunc,
+                       {Table, Builder.getInt32(Entries.size())});
+    Builder.CreateRetVoid();
+    // Ahead of ordinary constructors, which may already call through
+    // function pointers
+    appendToGlobalCtors(M, Ctor, 1);
+  }
+  
+  // Probabilistic calling context (Bond & McKinley): each function loads
+  // the thread's context word V on entry and every call site stores
+  // 3 * V_entry + cs before the call. A callee therefore sees a value that
+  // encodes its whole calling context with high probability, and the
+  // runtime reads it as the context key of the hit.
+  static bool instrumentCallingContext(Function &F, GlobalVariable *PCC) {
+    std::vector<CallBase*> CallSites;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        auto *CB = dyn_cast<CallBase>(&I);
+        if (!CB || CB->isInlineAsm()) continue;
+        Function *Callee = CB->getCalledFunction();
+        if (Callee && (Callee->isIntrinsic() ||
+                       Callee->getName().startswith("profiling_")))
+          continue;
+        CallSites.push_back(CB);
+      }
+    }
+    if (CallSites.empty()) return false;
+    
+    Type *Int64Ty = PCC->getValueType();
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+    Value *Entry = EntryBuilder.CreateLoad(Int64Ty, PCC, "pcc.entry");
+    Value *Scaled = EntryBuilder.CreateMul(Entry, ConstantInt::get(Int64Ty, 3));
+    
+    unsigned Index = 0;
+    for (CallBase *CB : CallSites) {
+      // A call-site id that is stable across builds of the same source
+      std::string Key = (F.getName() + "#" + Twine(Index++)).str();
+      IRBuilder<> Builder(CB);
+      Builder.CreateStore(
+          Builder.CreateAdd(Scaled, ConstantInt::get(Int64Ty, xxHash64(Key))),
+          PCC);
+    }
+    return true;
+  }
+  
+  // Calling-context tree: profiling_cct_enter(name) moves the thread's
+  // current CCT node to the child for this function and returns the old
+  // one, which every exit path hands back to profiling_cct_exit. Because
+  // the exit restores a saved node rather than popping, paths that skip it
+  // (longjmp, unwinding through nounwind code) heal at the next exit of an
+  // enclosing function.
+  static void instrumentCCT(Function &F, FunctionCallee EnterFunc,
+                            FunctionCallee ExitFunc, StringPool &Strings) {
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+    Value *Parent = EntryBuilder.CreateCall(
+        EnterFunc, {Strings.get(F.getName())}, "cct.parent");
+    
+    // Unwinding can only leave functions that may throw; for those,
+    // EscapeEnumerator turns throwing calls into invokes whose cleanup pad
+    // runs the exit hook and resumes.
+    EscapeEnumerator EE(F, "cct.cleanup", /*HandleExceptions=*/!F.doesNotThrow());
+    while (IRBuilder<> *Builder = EE.Next())
+      Builder->CreateCall(ExitFunc, {Parent});
+  }
+  
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
     bool Modified = false;
     LLVMContext &Ctx = M.getContext();
     
+    if (!loadCatalog(Ctx))
+      return PreservedAnalyses::all();
+    
+    // Find the dangerous call sites through the use lists of the catalog
+    // entries the module actually declares, so the cost scales with the
+    // number of declarations and sites rather than with the size of the
+    // module. Declarations are classified rather than looked up by name
+    // because fortified and aliased spellings cannot be enumerated from
+    // the catalog.
+    FunctionAnalysisManager &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    MapVector<Function*, std::vector<CallBase*>> SitesByCaller;
+    DenseMap<const Function*, APIInfo> APIs;
+    for (Function &API : M) {
+      if (!API.isDeclaration() || API.use_empty())
+        continue;
+      Optional<APIInfo> Info;
+      if (!API.isIntrinsic())
+        Info = classifyAPI(API, FAM.getResult<TargetLibraryAnalysis>(API));
+      else if (ClMemIntrinsics)
+        Info = classifyMemIntrinsic(API);
+      if (!Info) continue;
+      APIs[&API] = *Info;
+      for (Use &U : API.uses()) {
+        // Calls, invokes and callbrs alike, but only as the callee; taking
+        // the address is not a call
+        auto *CB = dyn_cast<CallBase>(U.getUser());
+        if (!CB || !CB->isCallee(&U)) continue;
+        // Constant-length intrinsics are fixed-size copies the backend
+        // expands inline; counting them would only add overhead
+        if (API.isIntrinsic() &&
+            isa<ConstantInt>(cast<MemIntrinsic>(CB)->getLength()))
+          continue;
+        SitesByCaller[CB->getFunction()].push_back(CB);
+      }
+    }
+    
+    // Estimation leaves the module untouched, whatever else is enabled
+    if (ClCounting == CountingMode::Estimate) {
+      if (!SitesByCaller.empty())
+        writeProfileEstimate(M, SitesByCaller, APIs, FAM);
+      return PreservedAnalyses::all();
+    }
+    
+    // These modes touch every function, not only the ones with sites
+    bool WholeModule = ClKeepFramePointers || ClCallingContext ||
+                       ClCallingContextTree || ClIndirectCalls;
+    if (SitesByCaller.empty() && !WholeModule)
+      return PreservedAnalyses::all();
+    
     // Get or declare the profiling function in the runtime library
     // void profiling_log(const char* api_name, const char* caller_name)
     Type *Int8PtrTy = PointerType::getUnqual(Ctx);
@@ -32,58 +1877,228 @@ struct DangerousAPIPass : public PassInfoMixin<DangerousAPIPass> {
         false
     );
     
-    FunctionCallee LogFunc = M.getOrInsertFunction("profiling_log", LogFuncType);
-    
-    // List of dangerous APIs to instrument (starting with strcpy)
-    std::vector<std::string> DangerousAPIs = {"strcpy"};
-    
-    // Iterate through all functions in the module
-    for (Function &F : M) {
-      if (F.isDeclaration()) continue; // Skip declarations
-      
-      // Store instructions to instrument (can't modify while iterating)
-      std::vector<CallInst*> CallsToInstrument;
-      
-      for (BasicBlock &BB : F) {
-        for (Instruction &I : BB) {
-          if (auto *CI = dyn_cast<CallInst>(&I)) {
-            Function *CalledFunc = CI->getCalledFunction();
-            
-            // Check if this is a direct call to a dangerous API
-            if (CalledFunc && !CalledFunc->isIntrinsic()) {
-              std::string CalledName = CalledFunc->getName().str();
-              
-              // Check if it's in our dangerous API list
-              for (const auto &API : DangerousAPIs) {
-                if (CalledName == API) {
-                  CallsToInstrument.push_back(CI);
-                  break;
-                }
-              }
-            }
-          }
+    // The hooks only share memory with the module through the context word
+    // and the sample weight, which sites store right before calling them
+    bool PreserveMost = ClPreserveMost &&
+                        Triple(M.getTargetTriple()).getArch() == Triple::x86_64;
+    bool PrivateMemory =
+        !ClCallingContext && ClCounting != CountingMode::Sampling;
+    LogFunc = getLogHook(M, "profiling_log", LogFuncType, PreserveMost,
+                         PrivateMemory);
+    ColdStubs.clear();
+    
+    // Copy-family hooks also carry the copy length:
+    // void profiling_log_size(const char*, const char*, unsigned long long)
+    // void profiling_log_str(const char*, const char*, const char* src)
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    LogSizeFunc = getLogHook(
+        M, "profiling_log_size",
+        FunctionType::get(Type::getVoidTy(Ctx), {Int8PtrTy, Int8PtrTy, Int64Ty},
+                          false),
+        PreserveMost, PrivateMemory);
+    LogStrFunc = getLogHook(
+        M, "profiling_log_str",
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {Int8PtrTy, Int8PtrTy, Int8PtrTy}, false),
+        PreserveMost, PrivateMemory);
+    
+    // Profile-guided density applies to the default counting mode only
+    ProfileSummaryInfo &PSI = MAM.getResult<ProfileSummaryAnalysis>(M);
+    bool ProfileGuided = ClProfileGuided && ClCounting == CountingMode::Call &&
+                         PSI.hasProfileSummary();
+    
+    // Counting modes report several executions at once:
+    // void profiling_log_count(const char*, const char*, unsigned long long n)
+    if (ClCounting == CountingMode::Promote || ProfileGuided ||
+        (ClCounting == CountingMode::Accumulate && ClCallingContextTree))
+      LogCountFunc = getLogHook(
+          M, "profiling_log_count",
+          FunctionType::get(Type::getVoidTy(Ctx),
+                            {Int8PtrTy, Int8PtrTy, Int64Ty}, false),
+          PreserveMost, PrivateMemory);
+    
+    // Calling-context tree hooks:
+    // void* profiling_cct_enter(const char* function_name)
+    // void profiling_cct_exit(void* saved_node)
+    FunctionCallee CCTEnterFunc, CCTExitFunc;
+    if (ClCallingContextTree) {
+      CCTEnterFunc = getRuntimeHook(
+          M, "profiling_cct_enter",
+          FunctionType::get(Int8PtrTy, {Int8PtrTy}, false));
+      CCTExitFunc = getRuntimeHook(
+          M, "profiling_cct_exit",
+          FunctionType::get(Type::getVoidTy(Ctx), {Int8PtrTy}, false));
+    }
+    
+    // Thread-local context word owned by the runtime
+    GlobalVariable *PCC = nullptr;
+    if (ClCallingContext) {
+      PCC = dyn_cast<GlobalVariable>(
+          M.getOrInsertGlobal("__dangerous_api_pcc", Int64Ty));
+      if (PCC)
+        PCC->setThreadLocal(true);
+    }
+    
+    StringPool Strings(M);
+    CounterModule Counters(M);
+    bool WarnedCCT = false;
+    
+    // Indirect-call target filter owned by the runtime
+    GlobalVariable *TargetFilter = nullptr;
+    FunctionCallee IndirectFunc;
+    if (ClIndirectCalls) {
+      TargetFilter = dyn_cast<GlobalVariable>(M.getOrInsertGlobal(
+          "__dangerous_api_target_filter",
+          ArrayType::get(Type::getInt8Ty(Ctx), TargetFilterBits / 8)));
+      // void profiling_log_indirect(void* target, const char* caller_name)
+      IndirectFunc = getRuntimeHook(
+          M, "profiling_log_indirect",
+          FunctionType::get(Type::getVoidTy(Ctx), {Int8PtrTy, Int8PtrTy},
+                            false));
+      registerIndirectTargets(M, APIs, Strings);
+    }
+    
+    std::vector<Function*> Worklist;
+    if (WholeModule) {
+      for (Function &F : M)
+        if (!F.isDeclaration()) Worklist.push_back(&F); // Skip declarations
+    } else {
+      for (auto &Sites : SitesByCaller)
+        Worklist.push_back(Sites.first);
+    }
+    
+    for (Function *FP : Worklist) {
+      Function &F = *FP;
+      
+      if (ClKeepFramePointers &&
+          F.getFnAttribute("frame-pointer").getValueAsString() != "all") {
+        F.addFnAttr("frame-pointer", "all");
+        Modified = true;
+      }
+      
+      if (PCC)
+        Modified |= instrumentCallingContext(F, PCC);
+      
+      std::vector<CallBase*> CallsToInstrument = SitesByCaller.lookup(&F);
+      OptimizationRemarkEmitter &ORE =
+          FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      
+      size_t NumSites = CallsToInstrument.size();
+      if (ClElideBounded && !CallsToInstrument.empty())
+        CallsToInstrument = elideBoundedSites(F, CallsToInstrument, APIs, FAM,
+                                              Counters, ORE, Strings);
+      size_t NumCounted = CallsToInstrument.size();
+      if (!CallsToInstrument.empty()) {
+        switch (ClCounting) {
+        case CountingMode::Call:
+          if (ProfileGuided)
+            CallsToInstrument = applyProfileDensity(
+                F, CallsToInstrument, APIs, FAM, PSI, Counters, ORE, Strings);
+          break;
+        case CountingMode::Promote:
+          CallsToInstrument = promoteLoopCounters(F, CallsToInstrument, APIs,
+                                                  FAM, ORE, Strings);
+          break;
+        case CountingMode::Spanning:
+          CallsToInstrument = instrumentSpanningTree(
+              F, CallsToInstrument, APIs, FAM, Counters, ORE, Strings);
+          break;
+        case CountingMode::Groups:
+          CallsToInstrument = instrumentSiteGroups(
+              F, CallsToInstrument, APIs, FAM, Counters, ORE, Strings);
+          break;
+        case CountingMode::Sleds:
+          CallsToInstrument =
+              emitSleds(F, CallsToInstrument, APIs, ORE, Strings);
+          break;
+        case CountingMode::Gated:
+          emitGatedHooks(F, CallsToInstrument, APIs, ORE, Strings);
+          CallsToInstrument.clear();
+          break;
+        case CountingMode::Sampling:
+          CallsToInstrument =
+              duplicateForSampling(F, CallsToInstrument, APIs, ORE, Strings);
+          break;
+        case CountingMode::Accumulate:
+          accumulatePerInvocation(F, CallsToInstrument, APIs, Counters, ORE,
+                                  Strings);
+          CallsToInstrument.clear();
+          break;
+        case CountingMode::Estimate:
+          llvm_unreachable("estimation returns before instrumenting");
         }
       }
       
+      // Counts the runtime recovers from module counters at exit belong to
+      // no calling context
+      if (ClCallingContextTree && !WarnedCCT &&
+          CallsToInstrument.size() < NumCounted &&
+          (ClCounting == CountingMode::Call ||
+           ClCounting == CountingMode::Spanning ||
+           ClCounting == CountingMode::Groups)) {
+        Ctx.diagnose(DiagnosticInfoUnsupported(
+            F,
+            "dangerous-api-pass: the calling-context tree leaves out sites "
+            "counted by module counters (spanning, groups and profile-guided "
+            "counting)",
+            DebugLoc(), DS_Warning));
+        WarnedCCT = true;
+      }
+      Modified |= CallsToInstrument.size() != NumSites;
+      
       // Now instrument the collected calls
-      for (CallInst *CI : CallsToInstrument) {
-        IRBuilder<> Builder(CI);
+      for (CallBase *CB : CallsToInstrument) {
+        // Inserting right before the call is valid for every CallBase: the
+        // hook is nounwind, so before an invoke it needs no EH edge of its
+        // own and counts the call whether it returns or unwinds.
+        IRBuilder<> Builder(CB);
+        Function *Callee = CB->getCalledFunction();
+        APIInfo Info = APIs.lookup(Callee);
         
-        // Create string constants for API name and caller function name
-        Value *APIName = Builder.CreateGlobalStringPtr(
-            CI->getCalledFunction()->getName()
-        );
-        Value *CallerName = Builder.CreateGlobalStringPtr(F.getName());
+        // String constants for API name and caller function name, shared
+        // by every site that names them
+        Value *APIName = Strings.get(siteAPIName(CB, Info));
+        Value *CallerName = Strings.get(F.getName());
         
         // Insert call to profiling_log BEFORE the dangerous API call
-        Builder.CreateCall(LogFunc, {APIName, CallerName});
+        emitSiteHook(Builder, CB, Info, APIName, CallerName);
         
         Modified = true;
+        ++NumSitesInstrumented;
+        if (Info.Fortified) ++NumFortifiedSites;
+        if (Callee->isIntrinsic()) ++NumIntrinsicSites;
         
-        errs() << "Instrumented " << CI->getCalledFunction()->getName() 
-               << " in function " << F.getName() << "\n";
+        // Filtered and serialised like any other remark
+        // (-pass-remarks=dangerous-api, -fsave-optimization-record)
+        ORE.emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "Instrumented", CB)
+                 << "instrumented call to "
+                 << ore::NV("API", siteAPIName(CB, Info))
+                 << " in " << ore::NV("Caller", F.getName());
+        });
+      }
+      
+      if (TargetFilter) {
+        std::vector<CallBase*> IndirectCalls;
+        for (BasicBlock &BB : F)
+          for (Instruction &I : BB)
+            if (auto *CB = dyn_cast<CallBase>(&I))
+              if (CB->isIndirectCall())
+                IndirectCalls.push_back(CB);
+        for (CallBase *CB : IndirectCalls)
+          instrumentIndirectCall(CB, F, TargetFilter, IndirectFunc, Strings);
+        NumIndirectSites += IndirectCalls.size();
+        Modified |= !IndirectCalls.empty();
+      }
+      
+      // Last, since EscapeEnumerator may rewrite calls into invokes
+      if (ClCallingContextTree) {
+        instrumentCCT(F, CCTEnterFunc, CCTExitFunc, Strings);
+        ++NumCCTFunctions;
+        Modified = true;
       }
     }
+    Counters.finalize();
     
     return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
@@ -3,24 +3,148 @@
  * 
  * This library collects execution statistics for dangerous API calls
  * and writes them to a JSON file on program exit.
+ *
+ * Environment:
+ *   DANGEROUS_API_STACK_DEPTH=N  capture up to N frame-pointer frames per
+ *                                call and count hits per (site, stack)
+ *   DANGEROUS_API_TOPK=K         keep (site, context) counts in per-thread
+ *                                Space-Saving sketches of K counters
+ *                                instead of the fixed context table and
+ *                                report the K heaviest pairs
+ *   DANGEROUS_API_SLEDS=all|api,...  patch the sleds of all or of the
+ *                                named APIs on at startup
+ *   DANGEROUS_API_GATES_OFF=all|api,...  clear the enable bytes of all or
+ *                                of the named APIs at startup
+ *   DANGEROUS_API_GATES_SHM=/name  mirror the enable bytes from a POSIX
+ *                                shared-memory control block that other
+ *                                processes can write
+ *   DANGEROUS_API_SAMPLE_INTERVAL=N  enter the sampled copies once every N
+ *                                checks (default 1000)
+ *
+ * Code built with -dangerous-api-pcc keeps a probabilistic calling-context
+ * value in __dangerous_api_pcc; hits are then also counted per
+ * (site, context value).
+ *
+ * Code built with -dangerous-api-indirect registers the addresses of the
+ * dangerous functions it takes the address of; indirect calls that land on
+ * one of them are counted like direct calls and tallied as indirect.
+ *
+ * Code built with -dangerous-api-cct reports function entries and exits;
+ * the runtime then builds a calling-context tree per thread and writes the
+ * merged tree, with dangerous-call counts on its nodes, under "cct".
+ *
+ * Code built with -dangerous-api-counting=promote reports the sites inside
+ * loops once per loop exit through profiling_log_count; those hits carry no
+ * size, stack or context value.
+ *
+ * Code built with -dangerous-api-counting=spanning only counts CFG edges
+ * and registers a descriptor of its functions; the site counts are solved
+ * for when the profile is written and likewise carry no size or context.
+ * With -dangerous-api-counting=groups the descriptor maps one counter to
+ * each group of control-equivalent sites instead, and with
+ * -dangerous-api-counting=accumulate one counter to each API a function
+ * calls, which the function adds its count to once per invocation.
+ *
+ * In modules built with a PGO profile, warm sites are counted the same way
+ * and hot sites report every Nth execution through profiling_log_count,
+ * with N fixed at compile time; only cold sites call the full hooks.
+ *
+ * Counts recovered from module counters when the profile is written belong
+ * to no calling context, so the "cct" tree leaves out the sites of
+ * spanning and groups builds and the PGO warm sites and remainders of hot
+ * ones; the pass warns about such builds. Accumulate builds with
+ * -dangerous-api-cct flush through profiling_log_count instead of a
+ * counter and keep the tree complete.
+ *
+ * -dangerous-api-counting=estimate needs no runtime at all: the pass writes
+ * a sidecar in the layout of dangerous_api_profile.json from the block
+ * counts of the PGO profile the build already uses.
+ *
+ * Code built with -dangerous-api-counting=sleds carries a no-op sled per
+ * site that costs nothing until it is patched into a call to the logging
+ * trampoline, per API or per site, through profiling_patch_sleds() and
+ * profiling_patch_sled() (x86-64, sleds linked with this runtime).
+ *
+ * Code built with -dangerous-api-counting=gated only calls the hooks of
+ * sites whose enable byte is set; profiling_set_gate() and
+ * profiling_set_gates() flip them per site or per API, and the profile
+ * lists every gate under "gates".
+ *
+ * Code built with -dangerous-api-counting=sampling runs an uninstrumented
+ * copy of each function with sites and switches into an instrumented copy
+ * once every N function entries and loop back edges, per thread. Sampled
+ * hits are weighted by N, so the counts are estimates; sizes, stacks and
+ * contexts describe the samples only.
+ *
+ * With -dangerous-api-preserve-most (x86-64) sites call the *_pm shims of
+ * the hooks with the preserve_most convention, so they keep their values
+ * in registers across the call.
+ *
+ * Copies the pass proves to fit their destination are not instrumented;
+ * they are listed under "elided_sites".
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
+#include <link.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #define MAX_ENTRIES 1024
 #define MAX_NAME_LEN 256
 
-// Structure to hold profiling data for each API-caller pair
+// Log2 size buckets: bucket 0 holds zero-length copies, bucket k (k >= 1)
+// holds sizes in [2^(k-1), 2^k), and the last bucket absorbs everything
+// from 2^(SIZE_BUCKETS-2) upwards.
+#define SIZE_BUCKETS 33
+
+#define MAX_STACK_DEPTH 64
+#define MAX_STACKS 4096       // must be a power of two
+#define MAX_CONTEXTS 16384    // must be a power of two
+#define MAX_PROBES 64
+#define MAX_TOPK 4096
+#define MAX_TARGETS 1024      // must be a power of two
+
+// Bitmap of possible dangerous call targets, tested inline by the pass
+// before calling profiling_log_indirect; bit (addr >> SHIFT) % BITS is set
+// for every registered target
+#define TARGET_FILTER_BYTES 4096
+#define TARGET_FILTER_SHIFT 4
+
+// Slot states for the lock-free open-addressed tables below
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+#define SLOT_READY 2
+
+// Kinds of calling context a (site, context) counter can be keyed by
+#define CONTEXT_STACK 1
+#define CONTEXT_PCC 2
+
+// Per-thread CCT arenas are carved out of chunks of this size
+#define CCT_ARENA_CHUNK (64 * 1024)
+
+// Structure to hold profiling data for each API-caller pair.
+// Everything below the names is updated with atomics so the hot path never
+// takes profile_mutex once the entry exists.
 typedef struct {
     char api_name[MAX_NAME_LEN];
     char caller_name[MAX_NAME_LEN];
     unsigned long count;
-    struct timespec first_call;
-    struct timespec last_call;
+    unsigned long long first_call_ns;
+    unsigned long long last_call_ns;
+    unsigned long size_samples;
+    unsigned long long size_total;
+    unsigned long size_hist[SIZE_BUCKETS];
+    unsigned long indirect_count;
 } ProfileEntry;
 
 // Global data structure
@@ -29,50 +153,1666 @@ static int num_entries = 0;
 static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int initialized = 0;
 
-// Function to find or create an entry
-static int find_or_create_entry(const char* api_name, const char* caller_name) {
-    // Search for existing entry
-    for (int i = 0; i < num_entries; i++) {
+// A unique call stack; its index in stack_table is the stack id
+typedef struct {
+    int state;
+    int depth;
+    unsigned long long hash;
+    void *frames[MAX_STACK_DEPTH];
+} StackRecord;
+
+// Hit count of one profile entry under one calling context
+typedef struct {
+    int state;
+    int entry;
+    int kind;
+    unsigned long long key;
+    unsigned long count;
+} ContextCount;
+
+static int stack_depth = 0;   // 0 disables stack capture
+static StackRecord stack_table[MAX_STACKS];
+static ContextCount context_counts[MAX_CONTEXTS];
+static unsigned long stacks_dropped = 0;
+static unsigned long contexts_dropped = 0;
+static __thread uintptr_t thread_stack_lo, thread_stack_hi;
+
+// Calling-context word written by instrumented code before each call; it
+// stays zero in code built without -dangerous-api-pcc
+__thread unsigned long long __dangerous_api_pcc = 0;
+static int pcc_seen = 0;
+
+// Sampling state of code built with -dangerous-api-counting=sampling: the
+// countdown to the next sample, the interval it is rearmed with, and the
+// weight the sampled copy stores right before each hook it calls
+#define DEFAULT_SAMPLE_INTERVAL 1000
+__thread int __dangerous_api_sample_countdown = DEFAULT_SAMPLE_INTERVAL;
+int __dangerous_api_sample_interval = DEFAULT_SAMPLE_INTERVAL;
+__thread unsigned long long __dangerous_api_sample_weight = 0;
+static int samples_seen = 0;
+
+// Dangerous-call count attached to a CCT node
+typedef struct CCTApiCount {
+    const char *api_name;
+    unsigned long count;
+    struct CCTApiCount *next;
+} CCTApiCount;
+
+// A calling context: the path of function entries from the thread's root.
+// Nodes are only touched by their owning thread while it runs.
+typedef struct CCTNode {
+    const char *function_name;
+    unsigned long calls;
+    struct CCTNode *parent;
+    struct CCTNode *children;
+    struct CCTNode *next_sibling;
+    CCTApiCount *apis;
+} CCTNode;
+
+// Bump allocator owned by one thread
+typedef struct CCTArena {
+    char *chunk;
+    size_t used;
+} CCTArena;
+
+// Thread roots, registered once per thread, merged at dump time
+typedef struct CCTThread {
+    CCTNode root;
+    CCTArena arena;
+    struct CCTThread *next;
+} CCTThread;
+
+static CCTThread *cct_threads = NULL;
+static pthread_mutex_t cct_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread CCTThread *cct_thread = NULL;
+static __thread CCTNode *cct_current = NULL;
+
+// One monitored (site, context) key of a Space-Saving sketch; count
+// overestimates the true count by at most error
+typedef struct {
+    int entry;
+    int kind;
+    unsigned long long key;
+    unsigned long count;
+    unsigned long error;
+} HeavyHitter;
+
+// Per-thread Space-Saving sketch: topk_size counters, an open-addressed
+// index from key to counter and a min-heap of the counters by count, with
+// each counter's position in it. Finding a key is O(1) and updating the
+// heap after a hit or an eviction O(log topk_size).
+typedef struct TopKSketch {
+    int size;
+    HeavyHitter *slots;
+    int *index;
+    unsigned index_mask;
+    int *heap;
+    int *heap_pos;
+    struct TopKSketch *next;
+} TopKSketch;
+
+static int topk_size = 0;   // 0 disables the sketches
+static TopKSketch *topk_sketches = NULL;
+static pthread_mutex_t topk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread TopKSketch *topk_sketch = NULL;
+
+// Layout of the per-module tables passed to profiling_register_targets
+typedef struct {
+    void *address;
+    const char *api_name;
+} DangerousTarget;
+
+unsigned char __dangerous_api_target_filter[TARGET_FILTER_BYTES];
+static DangerousTarget targets[MAX_TARGETS];
+static pthread_mutex_t targets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Layouts of the per-module descriptor passed to profiling_register_module.
+// A function is described either by its CFG or by groups of sites.
+// CFG nodes are the function's blocks followed by a virtual exit node; an
+// edge's counter is its index into the module counters, or -1 if the edge
+// is solved for from the others.
+typedef struct {
+    int src;
+    int dst;
+    int counter;
+} DangerousEdge;
+
+typedef struct {
+    const char *api_name;
+    int node;         // -1 for sites counted by a group
+} DangerousSite;
+
+// Control-equivalent sites sharing one counter; they are consecutive in
+// the function's site table. Sampled sites have already reported every
+// full period through profiling_log_count and leave only the remainder.
+typedef struct {
+    int counter;
+    int first_site;
+    int num_sites;
+    int period;       // 0 if the site never reports by itself
+} DangerousGroup;
+
+typedef struct {
+    const char *name;
+    int num_nodes;
+    int num_edges;
+    int num_sites;
+    int num_groups;
+    const DangerousEdge *edges;
+    const DangerousSite *sites;
+    const DangerousGroup *groups;
+} DangerousFunction;
+
+// A site the pass left uninstrumented because its copy provably fits
+typedef struct {
+    const char *api_name;
+    const char *caller_name;
+    unsigned long long copy_bytes;
+    unsigned long long object_bytes;
+} DangerousElidedSite;
+
+typedef struct DangerousModule {
+    int num_functions;
+    int num_elided;
+    const DangerousFunction *functions;
+    const DangerousElidedSite *elided;
+    unsigned long long *counters;
+    struct DangerousModule *next;
+} DangerousModule;
+
+static DangerousModule *modules = NULL;
+static pthread_mutex_t modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Sled records the pass emits into the dapi_sleds section; a sled's id is
+// its index between the linker-provided bounds
+typedef struct {
+    unsigned char *address;
+    const char *api_name;
+    const char *caller_name;
+} DangerousSled;
+
+extern DangerousSled __start_dapi_sleds[] __attribute__((weak));
+extern DangerousSled __stop_dapi_sleds[] __attribute__((weak));
+static pthread_mutex_t sleds_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-site enable byte records the pass emits into the dapi_gates section;
+// a gate's id is its index
+typedef struct {
+    unsigned char *enabled;
+    const char *api_name;
+    const char *caller_name;
+} DangerousGate;
+
+extern DangerousGate __start_dapi_gates[] __attribute__((weak));
+extern DangerousGate __stop_dapi_gates[] __attribute__((weak));
+
+// Layout of the DANGEROUS_API_GATES_SHM control block. It is polled every
+// GATE_POLL_MS and a change of enable[id] is applied to gate id, so it does
+// not undo what the program itself sets through the API. A block whose
+// num_gates no longer matches the binary's is ignored.
+typedef struct {
+    uint32_t magic;
+    uint32_t num_gates;
+    unsigned char enable[];
+} GateControl;
+
+#define GATE_SHM_MAGIC 0x44415047   // "GPAD"
+#define GATE_POLL_MS 100
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Searches the first n entries for an API-caller pair
+static int find_entry(const char* api_name, const char* caller_name, int n) {
+    for (int i = 0; i < n; i++) {
         if (strcmp(profile_data[i].api_name, api_name) == 0 &&
             strcmp(profile_data[i].caller_name, caller_name) == 0) {
             return i;
         }
     }
+    return -1;
+}
+
+// Function to find or create an entry.
+// Entries are only ever appended and become visible through the release
+// store of num_entries, so lookups of existing entries need no lock; the
+// mutex only serialises creation.
+static int find_or_create_entry(const char* api_name, const char* caller_name) {
+    int n = __atomic_load_n(&num_entries, __ATOMIC_ACQUIRE);
+    int idx = find_entry(api_name, caller_name, n);
+    if (idx >= 0) {
+        return idx;
+    }
+    
+    pthread_mutex_lock(&profile_mutex);
+    
+    // Another thread may have created it while we waited
+    idx = find_entry(api_name, caller_name, num_entries);
     
     // Creates new entry if space available
-    if (num_entries < MAX_ENTRIES) {
-        int idx = num_entries++;
+    if (idx < 0 && num_entries < MAX_ENTRIES) {
+        idx = num_entries;
         strncpy(profile_data[idx].api_name, api_name, MAX_NAME_LEN - 1);
         strncpy(profile_data[idx].caller_name, caller_name, MAX_NAME_LEN - 1);
         profile_data[idx].count = 0;
-        clock_gettime(CLOCK_MONOTONIC, &profile_data[idx].first_call);
-        return idx;
+        profile_data[idx].first_call_ns = now_ns();
+        profile_data[idx].last_call_ns = profile_data[idx].first_call_ns;
+        __atomic_store_n(&num_entries, idx + 1, __ATOMIC_RELEASE);
     }
     
-    return -1; // No space
+    pthread_mutex_unlock(&profile_mutex);
+    return idx; // -1 if no space
+}
+
+static void record_call(ProfileEntry *e, unsigned long long n) {
+    __atomic_fetch_add(&e->count, n, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->last_call_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+// splitmix64 finaliser
+static unsigned long long mix64(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Waits for a slot another thread is filling in, returns its final state
+static int slot_state(int *state) {
+    int s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    while (s == SLOT_BUSY) {
+        s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    }
+    return s;
+}
+
+static int claim_slot(int *state) {
+    int expected = SLOT_EMPTY;
+    return __atomic_compare_exchange_n(state, &expected, SLOT_BUSY, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+}
+
+static unsigned long long context_hash(int entry, int kind,
+                                       unsigned long long key) {
+    return mix64(key ^ ((unsigned long long)entry << 32) ^ (unsigned)kind);
+}
+
+// Finds or creates the counter for (entry, kind, key) without locking
+static ContextCount *find_or_create_context(int entry, int kind,
+                                            unsigned long long key) {
+    unsigned long long h = context_hash(entry, kind, key);
+    for (int probe = 0; probe < MAX_PROBES; probe++) {
+        ContextCount *c = &context_counts[(h + probe) & (MAX_CONTEXTS - 1)];
+        if (claim_slot(&c->state)) {
+            c->entry = entry;
+            c->kind = kind;
+            c->key = key;
+            __atomic_store_n(&c->state, SLOT_READY, __ATOMIC_RELEASE);
+            return c;
+        }
+        slot_state(&c->state);
+        if (c->entry == entry && c->kind == kind && c->key == key) {
+            return c;
+        }
+    }
+    __atomic_fetch_add(&contexts_dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static TopKSketch *thread_sketch(void) {
+    if (!topk_sketch) {
+        unsigned index_size = 1;
+        while (index_size < 2u * topk_size) {
+            index_size <<= 1;
+        }
+        TopKSketch *s = calloc(1, sizeof(TopKSketch));
+        if (!s) {
+            return NULL;
+        }
+        s->slots = calloc(topk_size, sizeof(HeavyHitter));
+        s->index = malloc(index_size * sizeof(int));
+        s->heap = malloc(topk_size * sizeof(int));
+        s->heap_pos = malloc(topk_size * sizeof(int));
+        if (!s->slots || !s->index || !s->heap || !s->heap_pos) {
+            free(s->slots);
+            free(s->index);
+            free(s->heap);
+            free(s->heap_pos);
+            free(s);
+            return NULL;
+        }
+        memset(s->index, 0xff, index_size * sizeof(int));
+        s->index_mask = index_size - 1;
+        pthread_mutex_lock(&topk_mutex);
+        s->next = topk_sketches;
+        topk_sketches = s;
+        pthread_mutex_unlock(&topk_mutex);
+        topk_sketch = s;
+    }
+    return topk_sketch;
+}
+
+static unsigned sketch_home(TopKSketch *s, HeavyHitter *h) {
+    return context_hash(h->entry, h->kind, h->key) & s->index_mask;
+}
+
+static int sketch_find(TopKSketch *s, int entry, int kind,
+                       unsigned long long key) {
+    for (unsigned i = context_hash(entry, kind, key) & s->index_mask;;
+         i = (i + 1) & s->index_mask) {
+        int slot = s->index[i];
+        if (slot < 0) {
+            return -1;
+        }
+        HeavyHitter *h = &s->slots[slot];
+        if (h->entry == entry && h->kind == kind && h->key == key) {
+            return slot;
+        }
+    }
+}
+
+static void sketch_index_insert(TopKSketch *s, int slot) {
+    unsigned i = sketch_home(s, &s->slots[slot]);
+    while (s->index[i] >= 0) {
+        i = (i + 1) & s->index_mask;
+    }
+    s->index[i] = slot;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void sketch_index_remove(TopKSketch *s, int slot) {
+    unsigned i = sketch_home(s, &s->slots[slot]);
+    while (s->index[i] != slot) {
+        i = (i + 1) & s->index_mask;
+    }
+    for (unsigned j = (i + 1) & s->index_mask; s->index[j] >= 0;
+         j = (j + 1) & s->index_mask) {
+        unsigned home = sketch_home(s, &s->slots[s->index[j]]);
+        if (((j - home) & s->index_mask) >= ((j - i) & s->index_mask)) {
+            s->index[i] = s->index[j];
+            i = j;
+        }
+    }
+    s->index[i] = -1;
+}
+
+static void sketch_heap_set(TopKSketch *s, int pos, int slot) {
+    s->heap[pos] = slot;
+    s->heap_pos[slot] = pos;
+}
+
+static void sketch_sift_up(TopKSketch *s, int pos) {
+    int slot = s->heap[pos];
+    unsigned long count = s->slots[slot].count;
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (s->slots[s->heap[parent]].count <= count) {
+            break;
+        }
+        sketch_heap_set(s, pos, s->heap[parent]);
+        pos = parent;
+    }
+    sketch_heap_set(s, pos, slot);
+}
+
+// Only moves a counter past strictly smaller ones, so a heavy hitter
+// that has sunk below its peers stays put on later hits
+static void sketch_sift_down(TopKSketch *s, int pos) {
+    int slot = s->heap[pos];
+    unsigned long count = s->slots[slot].count;
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= s->size) {
+            break;
+        }
+        if (child + 1 < s->size &&
+            s->slots[s->heap[child + 1]].count <
+                s->slots[s->heap[child]].count) {
+            child++;
+        }
+        if (s->slots[s->heap[child]].count >= count) {
+            break;
+        }
+        sketch_heap_set(s, pos, s->heap[child]);
+        pos = child;
+    }
+    sketch_heap_set(s, pos, slot);
+}
+
+// Space-Saving update: count monitored keys, otherwise take over the
+// counter with the smallest count, the root of the heap, and inherit it
+// as the error bound
+static void sketch_record(int entry, int kind, unsigned long long key) {
+    TopKSketch *s = thread_sketch();
+    if (!s) {
+        return;
+    }
+    
+    int slot = sketch_find(s, entry, kind, key);
+    if (slot >= 0) {
+        __atomic_store_n(&s->slots[slot].count, s->slots[slot].count + 1,
+                         __ATOMIC_RELAXED);
+        sketch_sift_down(s, s->heap_pos[slot]);
+        return;
+    }
+    
+    unsigned long min_count = 0;
+    if (s->size < topk_size) {
+        slot = s->size;
+    } else {
+        slot = s->heap[0];
+        min_count = s->slots[slot].count;
+        sketch_index_remove(s, slot);
+    }
+    
+    HeavyHitter *h = &s->slots[slot];
+    h->entry = entry;
+    h->kind = kind;
+    h->key = key;
+    h->error = min_count;
+    __atomic_store_n(&h->count, min_count + 1, __ATOMIC_RELAXED);
+    sketch_index_insert(s, slot);
+    if (slot == s->size) {
+        sketch_heap_set(s, slot, slot);
+        __atomic_store_n(&s->size, s->size + 1, __ATOMIC_RELEASE);
+        sketch_sift_up(s, slot);
+    } else {
+        sketch_sift_down(s, 0);
+    }
+}
+
+static void record_context(int entry, int kind, unsigned long long key) {
+    if (topk_size > 0) {
+        sketch_record(entry, kind, key);
+        return;
+    }
+    
+    ContextCount *c = find_or_create_context(entry, kind, key);
+    if (c) {
+        __atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Interns a stack and returns its id, or -1 if the table is full
+static int intern_stack(void **frames, int depth) {
+    unsigned long long h = depth;
+    for (int i = 0; i < depth; i++) {
+        h = mix64(h ^ (uintptr_t)frames[i]);
+    }
+    for (int probe = 0; probe < MAX_PROBES; probe++) {
+        int id = (h + probe) & (MAX_STACKS - 1);
+        StackRecord *r = &stack_table[id];
+        if (claim_slot(&r->state)) {
+            r->hash = h;
+            r->depth = depth;
+            memcpy(r->frames, frames, depth * sizeof(void *));
+            __atomic_store_n(&r->state, SLOT_READY, __ATOMIC_RELEASE);
+            return id;
+        }
+        slot_state(&r->state);
+        if (r->hash == h && r->depth == depth &&
+            memcmp(r->frames, frames, depth * sizeof(void *)) == 0) {
+            return id;
+        }
+    }
+    __atomic_fetch_add(&stacks_dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+// Caches the bounds of the current thread's stack so the frame walk never
+// dereferences a pointer outside it
+static void get_stack_bounds(uintptr_t *lo, uintptr_t *hi) {
+    if (thread_stack_hi == 0) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        thread_stack_lo = 0;
+        thread_stack_hi = UINTPTR_MAX;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                thread_stack_lo = (uintptr_t)addr;
+                thread_stack_hi = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    *lo = thread_stack_lo;
+    *hi = thread_stack_hi;
+}
+
+// Walks the frame-pointer chain starting at a hook's own frame, so
+// frames[0] is the return address into the instrumented call site.
+// Code built without frame pointers truncates the walk rather than
+// crashing it: every frame must lie in the thread's stack and the chain
+// must grow strictly upwards.
+static int capture_stack(void *frame, void **frames, int max_depth) {
+    uintptr_t lo, hi;
+    get_stack_bounds(&lo, &hi);
+    
+    int depth = 0;
+    void **fp = (void **)frame;
+    while (depth < max_depth && fp &&
+           ((uintptr_t)fp & (sizeof(void *) - 1)) == 0 &&
+           (uintptr_t)fp >= lo && (uintptr_t)(fp + 2) <= hi) {
+        void *ret = fp[1];
+        if (!ret) {
+            break;
+        }
+        frames[depth++] = ret;
+        void **next = (void **)fp[0];
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+// Attributes a hit of entry idx to the caller's full stack
+static void record_stack(int idx, void *frame) {
+    void *frames[MAX_STACK_DEPTH];
+    int depth = capture_stack(frame, frames, stack_depth);
+    int id = intern_stack(frames, depth);
+    if (id >= 0) {
+        record_context(idx, CONTEXT_STACK, (unsigned long long)id);
+    }
+}
+
+static int size_bucket(unsigned long long size) {
+    if (size == 0) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll(size);
+    return bucket < SIZE_BUCKETS ? bucket : SIZE_BUCKETS - 1;
+}
+
+static void *cct_alloc(CCTArena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (!arena->chunk || arena->used + size > CCT_ARENA_CHUNK) {
+        arena->chunk = calloc(1, CCT_ARENA_CHUNK);
+        arena->used = 0;
+        if (!arena->chunk) {
+            return NULL;
+        }
+    }
+    void *p = arena->chunk + arena->used;
+    arena->used += size;
+    return p;
+}
+
+// Returns the calling thread's current node, registering the thread first
+static CCTNode *cct_current_node(void) {
+    if (!cct_thread) {
+        CCTThread *t = calloc(1, sizeof(CCTThread));
+        if (!t) {
+            return NULL;
+        }
+        t->root.function_name = "<root>";
+        pthread_mutex_lock(&cct_mutex);
+        t->next = cct_threads;
+        cct_threads = t;
+        pthread_mutex_unlock(&cct_mutex);
+        cct_thread = t;
+        cct_current = &t->root;
+    }
+    return cct_current;
+}
+
+// Children are published with release stores so a dump racing with a
+// still-running thread sees fully initialised nodes
+static CCTNode *cct_child(CCTNode *parent, const char *function_name) {
+    for (CCTNode *c = parent->children; c; c = c->next_sibling) {
+        if (c->function_name == function_name ||
+            strcmp(c->function_name, function_name) == 0) {
+            return c;
+        }
+    }
+    CCTNode *c = cct_alloc(&cct_thread->arena, sizeof(CCTNode));
+    if (!c) {
+        return parent;
+    }
+    c->function_name = function_name;
+    c->parent = parent;
+    c->next_sibling = parent->children;
+    __atomic_store_n(&parent->children, c, __ATOMIC_RELEASE);
+    return c;
+}
+
+static void cct_record(CCTNode *node, const char *api_name,
+                       unsigned long long n) {
+    CCTApiCount *a;
+    for (a = node->apis; a; a = a->next) {
+        if (a->api_name == api_name || strcmp(a->api_name, api_name) == 0) {
+            break;
+        }
+    }
+    if (!a) {
+        a = cct_alloc(&cct_thread->arena, sizeof(CCTApiCount));
+        if (!a) {
+            return;
+        }
+        a->api_name = api_name;
+        a->next = node->apis;
+        __atomic_store_n(&node->apis, a, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&a->count, a->count + n, __ATOMIC_RELAXED);
+}
+
+// Entry hook inserted by -dangerous-api-cct; returns the node to restore
+void *profiling_cct_enter(const char *function_name) {
+    CCTNode *parent = cct_current_node();
+    if (!parent) {
+        return NULL;
+    }
+    CCTNode *node = cct_child(parent, function_name);
+    __atomic_store_n(&node->calls, node->calls + 1, __ATOMIC_RELAXED);
+    cct_current = node;
+    return parent;
+}
+
+// Exit hook, run on every return and unwind path of the function
+void profiling_cct_exit(void *saved_node) {
+    if (saved_node) {
+        cct_current = (CCTNode *)saved_node;
+    }
+}
+
+// Called from a constructor in every module built with
+// -dangerous-api-indirect. Registration locks; lookups do not, since an
+// entry's name is published before its address.
+void profiling_register_targets(const DangerousTarget *table, int count) {
+    pthread_mutex_lock(&targets_mutex);
+    for (int i = 0; i < count; i++) {
+        uintptr_t addr = (uintptr_t)table[i].address;
+        if (!addr) {
+            continue;
+        }
+        for (int probe = 0; probe < MAX_TARGETS; probe++) {
+            DangerousTarget *t =
+                &targets[(mix64(addr) + probe) & (MAX_TARGETS - 1)];
+            if (t->address == table[i].address) {
+                break;
+            }
+            if (!t->address) {
+                t->api_name = table[i].api_name;
+                __atomic_store_n(&t->address, table[i].address,
+                                 __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        unsigned bit = (addr >> TARGET_FILTER_SHIFT) %
+                       (TARGET_FILTER_BYTES * 8);
+        __atomic_fetch_or(&__dangerous_api_target_filter[bit / 8],
+                          (unsigned char)(1u << (bit % 8)), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&targets_mutex);
+}
+
+static const char *find_target(void *address) {
+    uintptr_t addr = (uintptr_t)address;
+    for (int probe = 0; probe < MAX_TARGETS; probe++) {
+        DangerousTarget *t =
+            &targets[(mix64(addr) + probe) & (MAX_TARGETS - 1)];
+        void *a = __atomic_load_n(&t->address, __ATOMIC_ACQUIRE);
+        if (a == address) {
+            return t->api_name;
+        }
+        if (!a) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Common tail of the hooks; frame is the exported hook's own frame
+static int log_hit(const char* api_name, const char* caller_name,
+                   void *frame) {
+    // A sampled hit stands for a whole interval of executions; only the
+    // counts are scaled, sizes, stacks and contexts stay per sample
+    unsigned long long weight = __dangerous_api_sample_weight;
+    if (weight != 0) {
+        __dangerous_api_sample_weight = 0;
+        if (!__atomic_load_n(&samples_seen, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&samples_seen, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        weight = 1;
+    }
+    
+    int idx = find_or_create_entry(api_name, caller_name);
+    if (idx < 0) {
+        return -1;
+    }
+    
+    record_call(&profile_data[idx], weight);
+    if (stack_depth > 0) {
+        record_stack(idx, frame);
+    }
+    
+    // The pass stores the site's context value right before calling us
+    unsigned long long pcc = __dangerous_api_pcc;
+    if (pcc != 0) {
+        if (!__atomic_load_n(&pcc_seen, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&pcc_seen, 1, __ATOMIC_RELAXED);
+        }
+        record_context(idx, CONTEXT_PCC, pcc);
+    }
+    
+    if (cct_current) {
+        cct_record(cct_current, profile_data[idx].api_name, weight);
+    }
+    return idx;
+}
+
+static void log_size(const char* api_name, const char* caller_name,
+                     unsigned long long size, void *frame) {
+    int idx = log_hit(api_name, caller_name, frame);
+    if (idx < 0) {
+        return;
+    }
+    
+    ProfileEntry *e = &profile_data[idx];
+    __atomic_fetch_add(&e->size_samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->size_total, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->size_hist[size_bucket(size)], 1, __ATOMIC_RELAXED);
 }
 
 // Main profiling function called by instrumented code
 void profiling_log(const char* api_name, const char* caller_name) {
-    pthread_mutex_lock(&profile_mutex);
-    
+    log_hit(api_name, caller_name, __builtin_frame_address(0));
+}
+
+// Called instead of profiling_log for copy-family APIs; size is the number
+// of bytes the call is about to copy.
+void profiling_log_size(const char* api_name, const char* caller_name,
+                        unsigned long long size) {
+    log_size(api_name, caller_name, size, __builtin_frame_address(0));
+}
+
+// Called by -dangerous-api-counting builds with n executions of a site at
+// once, typically at a loop exit. The stack and context value there are not
+// the site's, so only the totals and the CCT node are credited.
+void profiling_log_count(const char* api_name, const char* caller_name,
+                         unsigned long long n) {
+    if (n == 0) {
+        return;
+    }
     int idx = find_or_create_entry(api_name, caller_name);
-    if (idx >= 0) {
-        profile_data[idx].count++;
-        clock_gettime(CLOCK_MONOTONIC, &profile_data[idx].last_call);
+    if (idx < 0) {
+        return;
     }
     
-    pthread_mutex_unlock(&profile_mutex);
+    record_call(&profile_data[idx], n);
+    if (cct_current) {
+        cct_record(cct_current, profile_data[idx].api_name, n);
+    }
+}
+
+#if defined(__x86_64__)
+// preserve_most entry points of the hooks, called instead of them by code
+// built with -dangerous-api-preserve-most. The convention leaves every
+// general-purpose register but r11 to the callee, so the shim saves the
+// ones a C function may clobber; vector registers stay caller-saved. The
+// shim's own frame has the site as its return address, so it is passed on
+// as the frame stacks are walked from.
+#define PRESERVE_MOST_SHIM(name, target, pass_frame)                         \
+    __asm__(                                                                \
+        ".text\n"                                                           \
+        ".p2align 4\n"                                                      \
+        ".globl " #name "\n"                                                \
+        ".type " #name ", @function\n"                                      \
+        #name ":\n"                                                         \
+        "    pushq %rbp\n"                                                  \
+        "    movq %rsp, %rbp\n"                                             \
+        "    pushq %rax\n"                                                  \
+        "    pushq %rcx\n"                                                  \
+        "    pushq %rdx\n"                                                  \
+        "    pushq %rsi\n"                                                  \
+        "    pushq %rdi\n"                                                  \
+        "    pushq %r8\n"                                                   \
+        "    pushq %r9\n"                                                   \
+        "    pushq %r10\n"                                                  \
+        pass_frame                                                          \
+        "    call " #target "\n"                                            \
+        "    popq %r10\n"                                                   \
+        "    popq %r9\n"                                                    \
+        "    popq %r8\n"                                                    \
+        "    popq %rdi\n"                                                   \
+        "    popq %rsi\n"                                                   \
+        "    popq %rdx\n"                                                   \
+        "    popq %rcx\n"                                                   \
+        "    popq %rax\n"                                                   \
+        "    popq %rbp\n"                                                   \
+        "    ret\n"                                                         \
+        ".size " #name ", . - " #name "\n")
+
+static void log_pm(const char *api_name, const char *caller_name,
+                   void *frame) __attribute__((used));
+static void log_size_pm(const char *api_name, const char *caller_name,
+                        unsigned long long size, void *frame)
+    __attribute__((used));
+static void log_str_pm(const char *api_name, const char *caller_name,
+                       const char *src, void *frame) __attribute__((used));
+static void log_count_pm(const char *api_name, const char *caller_name,
+                         unsigned long long n) __attribute__((used));
+
+PRESERVE_MOST_SHIM(profiling_log_pm, log_pm, "    movq %rbp, %rdx\n");
+PRESERVE_MOST_SHIM(profiling_log_size_pm, log_size_pm,
+                   "    movq %rbp, %rcx\n");
+PRESERVE_MOST_SHIM(profiling_log_str_pm, log_str_pm, "    movq %rbp, %rcx\n");
+PRESERVE_MOST_SHIM(profiling_log_count_pm, log_count_pm, "");
+
+static void log_pm(const char *api_name, const char *caller_name,
+                   void *frame) {
+    log_hit(api_name, caller_name, frame);
+}
+
+static void log_size_pm(const char *api_name, const char *caller_name,
+                        unsigned long long size, void *frame) {
+    log_size(api_name, caller_name, size, frame);
+}
+
+static void log_str_pm(const char *api_name, const char *caller_name,
+                       const char *src, void *frame) {
+    log_size(api_name, caller_name, src ? strlen(src) + 1 : 0, frame);
+}
+
+static void log_count_pm(const char *api_name, const char *caller_name,
+                         unsigned long long n) {
+    profiling_log_count(api_name, caller_name, n);
+}
+#endif
+
+// Called from a constructor of every module with sites whose counts are
+// worked out at exit or that were left uninstrumented
+void profiling_register_module(DangerousModule *module) {
+    pthread_mutex_lock(&modules_mutex);
+    module->next = modules;
+    modules = module;
+    pthread_mutex_unlock(&modules_mutex);
+}
+
+// Sleds are "jmp .+11; nop9" when off and
+// "mov $id, %r10d; call __dangerous_api_sled_trampoline" when on
+#define SLED_SIZE 11
+#define SLED_OFF 0x09eb   // eb 09, little-endian
+#define SLED_ON 0xba41    // 41 ba
+
+// Number of sleds linked into this binary; ids run from 0 to this - 1
+int profiling_sled_count(void) {
+    if (!__start_dapi_sleds) {
+        return 0;
+    }
+    return (int)(__stop_dapi_sleds - __start_dapi_sleds);
+}
+
+#if defined(__x86_64__)
+static void sled_hit(unsigned id) __attribute__((used));
+
+// Bytes of the XSAVE area for the state components the OS enabled, or 0
+// to fall back to FXSAVE; set before the first sled is turned on
+static unsigned sled_xsave_size __attribute__((used)) = 0;
+
+// Entered from a patched sled with the sled id in r10. The sled sits in
+// the middle of compiled code where any register may be live, and
+// sled_hit and the libc calls below it may use any caller-saved vector
+// register, so the general-purpose ones it may clobber are pushed and the
+// whole extended state (x87, SSE, AVX, AVX-512 and mask registers) goes
+// through XSAVE into a 64-byte aligned area. The XSAVE header has to be
+// zeroed first, or XRSTOR faults on what the stack held before.
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".type __dangerous_api_sled_trampoline, @function\n"
+    "__dangerous_api_sled_trampoline:\n"
+    "    pushq %rbp\n"
+    "    movq %rsp, %rbp\n"
+    "    pushq %rax\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    movl sled_xsave_size(%rip), %eax\n"
+    "    testl %eax, %eax\n"
+    "    jz 1f\n"
+    "    subq %rax, %rsp\n"
+    "    andq $-64, %rsp\n"
+    "    movq $0, 512(%rsp)\n"
+    "    movq $0, 520(%rsp)\n"
+    "    movq $0, 528(%rsp)\n"
+    "    movq $0, 536(%rsp)\n"
+    "    movq $0, 544(%rsp)\n"
+    "    movq $0, 552(%rsp)\n"
+    "    movq $0, 560(%rsp)\n"
+    "    movq $0, 568(%rsp)\n"
+    "    movl $-1, %eax\n"
+    "    movl $-1, %edx\n"
+    "    xsave64 (%rsp)\n"
+    "    movl %r10d, %edi\n"
+    "    call sled_hit\n"
+    "    movl $-1, %eax\n"
+    "    movl $-1, %edx\n"
+    "    xrstor64 (%rsp)\n"
+    "    jmp 2f\n"
+    "1:\n"
+    "    subq $512, %rsp\n"
+    "    andq $-16, %rsp\n"
+    "    fxsave64 (%rsp)\n"
+    "    movl %r10d, %edi\n"
+    "    call sled_hit\n"
+    "    fxrstor64 (%rsp)\n"
+    "2:\n"
+    "    leaq -72(%rbp), %rsp\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rax\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size __dangerous_api_sled_trampoline, . - __dangerous_api_sled_trampoline\n");
+
+extern char __dangerous_api_sled_trampoline[];
+
+static void sled_hit(unsigned id) {
+    if (id < (unsigned)profiling_sled_count()) {
+        log_hit(__start_dapi_sleds[id].api_name,
+                __start_dapi_sleds[id].caller_name,
+                __builtin_frame_address(0));
+    }
+}
+
+// Size of the XSAVE area for the components enabled in XCR0, from CPUID
+// leaf 0xd, or 0 if the OS has not enabled XSAVE
+static unsigned xsave_area_size(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return ebx;
+}
+
+static int set_sled_writable(unsigned char *address, int writable) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    uintptr_t end = ((uintptr_t)address + SLED_SIZE + page - 1) & ~(page - 1);
+    return mprotect((void *)start, end - start,
+                    PROT_READ | PROT_EXEC | (writable ? PROT_WRITE : 0));
+}
+
+// The tail is written while the jump still skips it; the two-byte head is
+// then swapped in with one atomic store. Caller holds sleds_mutex.
+static int patch_sled_locked(int id, int enable) {
+    unsigned char *p = __start_dapi_sleds[id].address;
+    uint16_t head = enable ? SLED_ON : SLED_OFF;
+    if (__atomic_load_n((uint16_t *)p, __ATOMIC_RELAXED) == head) {
+        return 0;
+    }
+    
+    long long rel = (long long)((uintptr_t)__dangerous_api_sled_trampoline -
+                                (uintptr_t)(p + SLED_SIZE));
+    if (enable && rel != (int32_t)rel) {
+        return -1;   // trampoline out of call range
+    }
+    if (set_sled_writable(p, 1) != 0) {
+        return -1;
+    }
+    if (enable && !sled_xsave_size) {
+        sled_xsave_size = xsave_area_size();
+    }
+    if (enable) {
+        int32_t imm = id;
+        int32_t disp = (int32_t)rel;
+        memcpy(p + 2, &imm, sizeof(imm));
+        p[6] = 0xe8;
+        memcpy(p + 7, &disp, sizeof(disp));
+    }
+    __atomic_store_n((uint16_t *)p, head, __ATOMIC_RELEASE);
+    set_sled_writable(p, 0);
+    return 1;
+}
+#else
+static int patch_sled_locked(int id, int enable) {
+    (void)id;
+    (void)enable;
+    return -1;
+}
+#endif
+
+// Turns one sled on or off; returns 1 if it changed, 0 if it already was
+// in that state and -1 if it cannot be patched
+int profiling_patch_sled(int id, int enable) {
+    if (id < 0 || id >= profiling_sled_count()) {
+        return -1;
+    }
+    pthread_mutex_lock(&sleds_mutex);
+    int result = patch_sled_locked(id, enable);
+    pthread_mutex_unlock(&sleds_mutex);
+    return result;
+}
+
+// Turns the sleds of one API, or of all APIs if api_name is NULL, on or
+// off; returns the number changed, or -1 if any could not be patched
+int profiling_patch_sleds(const char *api_name, int enable) {
+    int changed = 0;
+    int failed = 0;
+    pthread_mutex_lock(&sleds_mutex);
+    for (int id = 0; id < profiling_sled_count(); id++) {
+        if (api_name && strcmp(__start_dapi_sleds[id].api_name, api_name) != 0) {
+            continue;
+        }
+        int result = patch_sled_locked(id, enable);
+        if (result < 0) {
+            failed = 1;
+        } else {
+            changed += result;
+        }
+    }
+    pthread_mutex_unlock(&sleds_mutex);
+    return failed ? -1 : changed;
+}
+
+// Number of enable bytes linked into this binary; ids run from 0 to this - 1
+int profiling_gate_count(void) {
+    if (!__start_dapi_gates) {
+        return 0;
+    }
+    return (int)(__stop_dapi_gates - __start_dapi_gates);
+}
+
+// Sets or clears one site's enable byte; returns its previous state, or
+// -1 for an unknown id
+int profiling_set_gate(int id, int enable) {
+    if (id < 0 || id >= profiling_gate_count()) {
+        return -1;
+    }
+    return __atomic_exchange_n(__start_dapi_gates[id].enabled,
+                               (unsigned char)(enable != 0), __ATOMIC_RELAXED);
+}
+
+// Sets or clears the enable bytes of one API, or of all APIs if api_name
+// is NULL; returns the number of sites matched
+int profiling_set_gates(const char *api_name, int enable) {
+    int matched = 0;
+    for (int id = 0; id < profiling_gate_count(); id++) {
+        if (api_name && strcmp(__start_dapi_gates[id].api_name, api_name) != 0) {
+            continue;
+        }
+        profiling_set_gate(id, enable);
+        matched++;
+    }
+    return matched;
+}
+
+// The mapped control block and the number of gates it was created for.
+// Other processes can write the whole block, so the watcher only ever
+// trusts this snapshot and skips polls while the header disagrees with it.
+typedef struct {
+    GateControl *control;
+    size_t size;
+    uint32_t num_gates;
+} GateWatch;
+
+static void *gate_watcher(void *arg) {
+    GateWatch *watch = arg;
+    GateControl *control = watch->control;
+    uint32_t num_gates = watch->num_gates;
+    unsigned char *seen = malloc(num_gates);
+    if (!seen) {
+        return NULL;
+    }
+    memcpy(seen, control->enable, num_gates);
+    
+    struct timespec interval = {0, GATE_POLL_MS * 1000000L};
+    for (;;) {
+        if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) ==
+                GATE_SHM_MAGIC &&
+            __atomic_load_n(&control->num_gates, __ATOMIC_RELAXED) ==
+                num_gates) {
+            for (uint32_t id = 0; id < num_gates; id++) {
+                unsigned char enable = __atomic_load_n(&control->enable[id],
+                                                       __ATOMIC_RELAXED);
+                if (enable != seen[id]) {
+                    seen[id] = enable;
+                    profiling_set_gate(id, enable);
+                }
+            }
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// Creates (or reuses) the control block, seeds it with the current enable
+// bytes and starts the thread that mirrors it into the gates
+static void start_gate_control(const char *name) {
+    int count = profiling_gate_count();
+    if (count == 0) {
+        return;
+    }
+    static GateWatch watch;
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: cannot open gate control %s\n", name);
+        return;
+    }
+    size_t size = sizeof(GateControl) + count;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return;
+    }
+    GateControl *control = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    close(fd);
+    if (control == MAP_FAILED) {
+        return;
+    }
+    for (int id = 0; id < count; id++) {
+        control->enable[id] = *__start_dapi_gates[id].enabled;
+    }
+    control->num_gates = count;
+    __atomic_store_n(&control->magic, GATE_SHM_MAGIC, __ATOMIC_RELEASE);
+    watch.control = control;
+    watch.size = size;
+    watch.num_gates = count;
+    
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, gate_watcher, &watch) != 0) {
+        munmap(control, size);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Called for indirect calls whose target passed the inline filter check;
+// filter collisions with harmless functions are discarded here
+void profiling_log_indirect(void *target, const char* caller_name) {
+    const char *api_name = find_target(target);
+    if (!api_name) {
+        return;
+    }
+    int idx = log_hit(api_name, caller_name, __builtin_frame_address(0));
+    if (idx >= 0) {
+        __atomic_fetch_add(&profile_data[idx].indirect_count, 1,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+// String-copy variant: the copy length is the source string plus its
+// terminator.
+void profiling_log_str(const char* api_name, const char* caller_name,
+                       const char* src) {
+    log_size(api_name, caller_name, src ? strlen(src) + 1 : 0,
+             __builtin_frame_address(0));
+}
+
+// _FORTIFY_SOURCE builds call the checked __X_chk variants
+static int is_fortified(const char *api_name) {
+    size_t len = strlen(api_name);
+    return len > 6 && strncmp(api_name, "__", 2) == 0 &&
+           strcmp(api_name + len - 4, "_chk") == 0;
 }
 
 // Calculates time difference in milliseconds
-static double time_diff_ms(struct timespec *start, struct timespec *end) {
-    return (end->tv_sec - start->tv_sec) * 1000.0 + 
-           (end->tv_nsec - start->tv_nsec) / 1000000.0;
+static double time_diff_ms(unsigned long long start_ns,
+                           unsigned long long end_ns) {
+    return (end_ns - start_ns) / 1000000.0;
+}
+
+// Writes the non-empty buckets of an entry's size histogram
+static void write_size_histogram(FILE *fp, ProfileEntry *e) {
+    fprintf(fp, "      \"bytes_copied\": %llu,\n", e->size_total);
+    fprintf(fp, "      \"size_histogram\": [");
+    int first = 1;
+    for (int b = 0; b < SIZE_BUCKETS; b++) {
+        if (e->size_hist[b] == 0) {
+            continue;
+        }
+        unsigned long long lo = b == 0 ? 0 : 1ULL << (b - 1);
+        fprintf(fp, "%s\n        {\"min_bytes\": %llu, ", first ? "" : ",", lo);
+        if (b == 0) {
+            fprintf(fp, "\"max_bytes\": 0, ");
+        } else if (b < SIZE_BUCKETS - 1) {
+            fprintf(fp, "\"max_bytes\": %llu, ", (1ULL << b) - 1);
+        }
+        fprintf(fp, "\"count\": %lu}", e->size_hist[b]);
+        first = 0;
+    }
+    fprintf(fp, "\n      ],\n");
+}
+
+// Writes the per-context hit counts of entry idx
+static void write_entry_contexts(FILE *fp, int idx, int kind,
+                                 const char *field, const char *key_name) {
+    fprintf(fp, "      \"%s\": [", field);
+    int first = 1;
+    for (int i = 0; i < MAX_CONTEXTS; i++) {
+        ContextCount *c = &context_counts[i];
+        if (c->state != SLOT_READY || c->entry != idx || c->kind != kind) {
+            continue;
+        }
+        fprintf(fp, "%s\n        {\"%s\": %llu, \"count\": %lu}",
+                first ? "" : ",", key_name, c->key, c->count);
+        first = 0;
+    }
+    fprintf(fp, "\n      ],\n");
+}
+
+typedef struct {
+    FILE *fp;
+    int first;
+} ModuleWriter;
+
+static int write_module(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    ModuleWriter *w = (ModuleWriter *)data;
+    char exe[4096];
+    const char *path = info->dlpi_name;
+    if (!path || !*path) {
+        ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        exe[n > 0 ? n : 0] = '\0';
+        path = exe;
+    }
+    fprintf(w->fp, "%s\n    {\"path\": \"%s\", \"base\": \"0x%lx\"}",
+            w->first ? "" : ",", path, (unsigned long)info->dlpi_addr);
+    w->first = 0;
+    return 0;
+}
+
+// Adds the counts of src and all its descendants into dst (plain heap
+// memory, dump time only)
+static void cct_merge(CCTNode *dst, CCTNode *src) {
+    dst->calls += src->calls;
+    for (CCTApiCount *a = __atomic_load_n(&src->apis, __ATOMIC_ACQUIRE); a;
+         a = a->next) {
+        CCTApiCount *d;
+        for (d = dst->apis; d; d = d->next) {
+            if (strcmp(d->api_name, a->api_name) == 0) {
+                break;
+            }
+        }
+        if (!d) {
+            d = calloc(1, sizeof(CCTApiCount));
+            if (!d) {
+                continue;
+            }
+            d->api_name = a->api_name;
+            d->next = dst->apis;
+            dst->apis = d;
+        }
+        d->count += a->count;
+    }
+    for (CCTNode *c = __atomic_load_n(&src->children, __ATOMIC_ACQUIRE); c;
+         c = c->next_sibling) {
+        CCTNode *d;
+        for (d = dst->children; d; d = d->next_sibling) {
+            if (strcmp(d->function_name, c->function_name) == 0) {
+                break;
+            }
+        }
+        if (!d) {
+            d = calloc(1, sizeof(CCTNode));
+            if (!d) {
+                continue;
+            }
+            d->function_name = c->function_name;
+            d->parent = dst;
+            d->next_sibling = dst->children;
+            dst->children = d;
+        }
+        cct_merge(d, c);
+    }
+}
+
+// Total dangerous calls made in node's subtree; empty subtrees are pruned
+static unsigned long cct_subtree_hits(CCTNode *node) {
+    unsigned long hits = 0;
+    for (CCTApiCount *a = node->apis; a; a = a->next) {
+        hits += a->count;
+    }
+    for (CCTNode *c = node->children; c; c = c->next_sibling) {
+        hits += cct_subtree_hits(c);
+    }
+    return hits;
+}
+
+static void cct_write_node(FILE *fp, CCTNode *node, int indent) {
+    fprintf(fp, "%*s{\"function\": \"%s\", \"calls\": %lu, "
+            "\"dangerous_calls\": [", indent, "", node->function_name,
+            node->calls);
+    for (CCTApiCount *a = node->apis; a; a = a->next) {
+        fprintf(fp, "%s{\"api_name\": \"%s\", \"count\": %lu}",
+                a == node->apis ? "" : ", ", a->api_name, a->count);
+    }
+    fprintf(fp, "], \"children\": [");
+    int first = 1;
+    for (CCTNode *c = node->children; c; c = c->next_sibling) {
+        if (cct_subtree_hits(c) == 0) {
+            continue;
+        }
+        fprintf(fp, "%s\n", first ? "" : ",");
+        cct_write_node(fp, c, indent + 2);
+        first = 0;
+    }
+    if (!first) {
+        fprintf(fp, "\n%*s", indent, "");
+    }
+    fprintf(fp, "]}");
+}
+
+// Merges the per-thread trees and writes the result
+static void write_cct(FILE *fp) {
+    CCTNode merged;
+    memset(&merged, 0, sizeof(merged));
+    merged.function_name = "<root>";
+    
+    pthread_mutex_lock(&cct_mutex);
+    for (CCTThread *t = cct_threads; t; t = t->next) {
+        cct_merge(&merged, &t->root);
+    }
+    pthread_mutex_unlock(&cct_mutex);
+    
+    fprintf(fp, "  \"cct\":\n");
+    cct_write_node(fp, &merged, 4);
+    fprintf(fp, ",\n");
+}
+
+// A sketch counter together with the minimum count of its sketch
+typedef struct {
+    HeavyHitter h;
+    unsigned long sketch_min;
+} MergeCandidate;
+
+static int compare_candidate_key(const void *a, const void *b) {
+    const HeavyHitter *x = &((const MergeCandidate *)a)->h;
+    const HeavyHitter *y = &((const MergeCandidate *)b)->h;
+    if (x->entry != y->entry) {
+        return x->entry < y->entry ? -1 : 1;
+    }
+    if (x->kind != y->kind) {
+        return x->kind < y->kind ? -1 : 1;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int compare_hitter_count(const void *a, const void *b) {
+    const HeavyHitter *x = a, *y = b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+// Merges the per-thread sketches (Agarwal et al. mergeable summaries): a
+// key missing from a full sketch may have been counted up to that
+// sketch's minimum, which is added to both its count and its error bound.
+static void write_heavy_hitters(FILE *fp) {
+    int total = 0;
+    unsigned long total_min = 0;
+    
+    pthread_mutex_lock(&topk_mutex);
+    for (TopKSketch *s = topk_sketches; s; s = s->next) {
+        total += s->size;
+    }
+    MergeCandidate *cands = calloc(total ? total : 1, sizeof(MergeCandidate));
+    HeavyHitter *merged = calloc(total ? total : 1, sizeof(HeavyHitter));
+    int n = 0;
+    for (TopKSketch *s = topk_sketches; s && cands && merged; s = s->next) {
+        int size = __atomic_load_n(&s->size, __ATOMIC_ACQUIRE);
+        unsigned long min = 0;
+        if (size == topk_size) {
+            min = s->slots[0].count;
+            for (int i = 1; i < size; i++) {
+                if (s->slots[i].count < min) {
+                    min = s->slots[i].count;
+                }
+            }
+        }
+        total_min += min;
+        for (int i = 0; i < size && n < total; i++) {
+            cands[n].h = s->slots[i];
+            cands[n].sketch_min = min;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&topk_mutex);
+    
+    int m = 0;
+    if (cands && merged) {
+        qsort(cands, n, sizeof(MergeCandidate), compare_candidate_key);
+        for (int i = 0; i < n; i++) {
+            if (i == 0 || compare_candidate_key(&cands[i], &cands[i - 1])) {
+                merged[m] = cands[i].h;
+                merged[m].count = total_min;
+                merged[m].error = total_min;
+                m++;
+            }
+            merged[m - 1].count += cands[i].h.count - cands[i].sketch_min;
+            merged[m - 1].error += cands[i].h.error - cands[i].sketch_min;
+        }
+        qsort(merged, m, sizeof(HeavyHitter), compare_hitter_count);
+    }
+    
+    fprintf(fp, "  \"heavy_hitters\": [");
+    for (int i = 0; i < m && i < topk_size; i++) {
+        HeavyHitter *h = &merged[i];
+        fprintf(fp, "%s\n    {\"api_name\": \"%s\", \"caller_function\": "
+                "\"%s\", ", i ? "," : "", profile_data[h->entry].api_name,
+                profile_data[h->entry].caller_name);
+        if (h->kind == CONTEXT_STACK) {
+            fprintf(fp, "\"stack_id\": %llu, ", h->key);
+        } else {
+            fprintf(fp, "\"context\": %llu, ", h->key);
+        }
+        fprintf(fp, "\"count\": %lu, \"error_bound\": %lu}", h->count,
+                h->error);
+    }
+    fprintf(fp, "\n  ],\n");
+    free(cands);
+    free(merged);
+}
+
+// Writes the interned stacks plus the load map needed to symbolize them
+// offline (addr2line on frame - base - 1, frames being return addresses)
+static void write_stack_table(FILE *fp) {
+    fprintf(fp, "  \"stack_table\": [");
+    int first = 1;
+    for (int id = 0; id < MAX_STACKS; id++) {
+        StackRecord *r = &stack_table[id];
+        if (r->state != SLOT_READY) {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"stack_id\": %d, \"frames\": [",
+                first ? "" : ",", id);
+        for (int d = 0; d < r->depth; d++) {
+            fprintf(fp, "%s\"%p\"", d ? ", " : "", r->frames[d]);
+        }
+        fprintf(fp, "]}");
+        first = 0;
+    }
+    fprintf(fp, "\n  ],\n");
+    fprintf(fp, "  \"modules\": [");
+    ModuleWriter w = {fp, 1};
+    dl_iterate_phdr(write_module, &w);
+    fprintf(fp, "\n  ],\n");
+}
+
+// Recovers the edge counts of a function from its counted edges: every
+// node conserves flow, so a node with a single unknown edge determines it,
+// and the counted edges are the complement of a spanning tree, so this
+// solves them all. Each site is then credited with the count of its block.
+// Frames still live at exit may leave the counts slightly unbalanced;
+// negative solutions are clamped to zero.
+static void flush_edges(const DangerousFunction *f,
+                        const unsigned long long *counters) {
+    int slots = f->num_edges + 2 * f->num_nodes;
+    long long *sums = calloc(slots, sizeof(long long));
+    int *flags = calloc(slots, sizeof(int));
+    if (!sums || !flags) {
+        free(sums);
+        free(flags);
+        return;
+    }
+    long long *count = sums;
+    long long *in_sum = sums + f->num_edges;
+    long long *out_sum = in_sum + f->num_nodes;
+    int *known = flags;
+    int *unknown = flags + f->num_edges;
+    int *unknown_edge = unknown + f->num_nodes;
+    
+    int remaining = 0;
+    for (int e = 0; e < f->num_edges; e++) {
+        if (f->edges[e].counter >= 0) {
+            count[e] = __atomic_load_n(&counters[f->edges[e].counter],
+                                       __ATOMIC_RELAXED);
+            known[e] = 1;
+        } else {
+            remaining++;
+        }
+    }
+    
+    while (remaining > 0) {
+        memset(in_sum, 0, f->num_nodes * sizeof(*in_sum));
+        memset(out_sum, 0, f->num_nodes * sizeof(*out_sum));
+        memset(unknown, 0, f->num_nodes * sizeof(*unknown));
+        for (int e = 0; e < f->num_edges; e++) {
+            const DangerousEdge *edge = &f->edges[e];
+            if (known[e]) {
+                out_sum[edge->src] += count[e];
+                in_sum[edge->dst] += count[e];
+            } else {
+                unknown[edge->src]++;
+                unknown_edge[edge->src] = e;
+                unknown[edge->dst]++;
+                unknown_edge[edge->dst] = e;
+            }
+        }
+        
+        int solved = 0;
+        for (int v = 0; v < f->num_nodes; v++) {
+            if (unknown[v] != 1 || known[unknown_edge[v]]) {
+                continue;
+            }
+            int e = unknown_edge[v];
+            long long value = f->edges[e].dst == v ? out_sum[v] - in_sum[v]
+                                                   : in_sum[v] - out_sum[v];
+            count[e] = value > 0 ? value : 0;
+            known[e] = 1;
+            remaining--;
+            solved++;
+        }
+        if (solved == 0) {
+            break;
+        }
+    }
+    
+    memset(in_sum, 0, f->num_nodes * sizeof(*in_sum));
+    for (int e = 0; e < f->num_edges; e++) {
+        in_sum[f->edges[e].dst] += count[e];
+    }
+    for (int i = 0; i < f->num_sites; i++) {
+        long long n = in_sum[f->sites[i].node];
+        if (n <= 0) {
+            continue;
+        }
+        int idx = find_or_create_entry(f->sites[i].api_name, f->name);
+        if (idx >= 0) {
+            record_call(&profile_data[idx], n);
+        }
+    }
+    
+    free(sums);
+    free(flags);
+}
+
+static void flush_groups(const DangerousFunction *f,
+                         const unsigned long long *counters) {
+    for (int g = 0; g < f->num_groups; g++) {
+        const DangerousGroup *group = &f->groups[g];
+        unsigned long long n = __atomic_load_n(&counters[group->counter],
+                                               __ATOMIC_RELAXED);
+        if (group->period > 0) {
+            n %= group->period;
+        }
+        if (n == 0) {
+            continue;
+        }
+        for (int i = 0; i < group->num_sites; i++) {
+            const DangerousSite *site = &f->sites[group->first_site + i];
+            int idx = find_or_create_entry(site->api_name, f->name);
+            if (idx >= 0) {
+                record_call(&profile_data[idx], n);
+            }
+        }
+    }
+}
+
+static void flush_modules(void) {
+    pthread_mutex_lock(&modules_mutex);
+    for (DangerousModule *m = modules; m; m = m->next) {
+        for (int i = 0; i < m->num_functions; i++) {
+            const DangerousFunction *f = &m->functions[i];
+            if (f->num_groups > 0) {
+                flush_groups(f, m->counters);
+            } else {
+                flush_edges(f, m->counters);
+            }
+        }
+    }
+    pthread_mutex_unlock(&modules_mutex);
+}
+
+// Sites proven in bounds at compile time; they have no counts
+static void write_elided_sites(FILE *fp) {
+    int total = 0;
+    fprintf(fp, "  \"elided_sites\": [\n");
+    for (DangerousModule *m = modules; m; m = m->next) {
+        for (int i = 0; i < m->num_elided; i++) {
+            const DangerousElidedSite *site = &m->elided[i];
+            fprintf(fp, "%s    {\"api_name\": \"%s\", "
+                    "\"caller_function\": \"%s\", \"copy_bytes\": %llu, "
+                    "\"object_bytes\": %llu}",
+                    total > 0 ? ",\n" : "", site->api_name, site->caller_name,
+                    site->copy_bytes, site->object_bytes);
+            total++;
+        }
+    }
+    fprintf(fp, "\n  ],\n");
+}
+
+// Lets operators find the ids to flip in a later run
+static void write_gates(FILE *fp) {
+    fprintf(fp, "  \"gates\": [\n");
+    for (int id = 0; id < profiling_gate_count(); id++) {
+        const DangerousGate *gate = &__start_dapi_gates[id];
+        fprintf(fp, "    {\"id\": %d, \"api_name\": \"%s\", "
+                "\"caller_function\": \"%s\", \"enabled\": %s}%s\n",
+                id, gate->api_name, gate->caller_name,
+                *gate->enabled ? "true" : "false",
+                id < profiling_gate_count() - 1 ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
 }
 
 // Writes profiling data to JSON file on exit
 static void write_profile_data(void) {
+    flush_modules();
+    
     FILE *fp = fopen("dangerous_api_profile.json", "w");
     if (!fp) {
         fprintf(stderr, "Error: Could not open output file\n");
@@ -88,23 +1828,72 @@ static void write_profile_data(void) {
     }
     
     for (int i = 0; i < num_entries; i++) {
-        double duration = time_diff_ms(&profile_data[i].first_call, 
-                                       &profile_data[i].last_call);
+        double duration = time_diff_ms(profile_data[i].first_call_ns, 
+                                       profile_data[i].last_call_ns);
         double percentage = total_calls > 0 ? 
                            (profile_data[i].count * 100.0 / total_calls) : 0.0;
         
         fprintf(fp, "    {\n");
         fprintf(fp, "      \"api_name\": \"%s\",\n", profile_data[i].api_name);
         fprintf(fp, "      \"caller_function\": \"%s\",\n", profile_data[i].caller_name);
+        fprintf(fp, "      \"fortified\": %s,\n",
+                is_fortified(profile_data[i].api_name) ? "true" : "false");
         fprintf(fp, "      \"execution_count\": %lu,\n", profile_data[i].count);
         fprintf(fp, "      \"percentage_of_total\": %.2f,\n", percentage);
+        if (profile_data[i].indirect_count > 0) {
+            fprintf(fp, "      \"indirect_calls\": %lu,\n",
+                    profile_data[i].indirect_count);
+        }
+        if (profile_data[i].size_samples > 0) {
+            write_size_histogram(fp, &profile_data[i]);
+        }
+        if (stack_depth > 0 && topk_size == 0) {
+            write_entry_contexts(fp, i, CONTEXT_STACK, "stacks", "stack_id");
+        }
+        if (pcc_seen && topk_size == 0) {
+            write_entry_contexts(fp, i, CONTEXT_PCC, "contexts", "context");
+        }
         fprintf(fp, "      \"duration_ms\": %.3f\n", duration);
         fprintf(fp, "    }%s\n", (i < num_entries - 1) ? "," : "");
     }
     
     fprintf(fp, "  ],\n");
+    int elided = 0;
+    for (DangerousModule *m = modules; m; m = m->next) {
+        elided += m->num_elided;
+    }
+    if (elided > 0) {
+        write_elided_sites(fp);
+    }
+    if (profiling_gate_count() > 0) {
+        write_gates(fp);
+    }
+    if (stack_depth > 0) {
+        write_stack_table(fp);
+    }
+    if (cct_threads) {
+        write_cct(fp);
+    }
+    if (topk_size > 0) {
+        write_heavy_hitters(fp);
+    }
     fprintf(fp, "  \"summary\": {\n");
     fprintf(fp, "    \"total_dangerous_calls\": %lu,\n", total_calls);
+    if (stack_depth > 0) {
+        fprintf(fp, "    \"stack_depth\": %d,\n", stack_depth);
+        fprintf(fp, "    \"stacks_dropped\": %lu,\n", stacks_dropped);
+        fprintf(fp, "    \"contexts_dropped\": %lu,\n", contexts_dropped);
+    }
+    if (topk_size > 0) {
+        fprintf(fp, "    \"topk\": %d,\n", topk_size);
+    }
+    if (samples_seen) {
+        fprintf(fp, "    \"sample_interval\": %d,\n",
+                __dangerous_api_sample_interval);
+    }
+    if (elided > 0) {
+        fprintf(fp, "    \"elided_sites\": %d,\n", elided);
+    }
     fprintf(fp, "    \"unique_call_sites\": %d\n", num_entries);
     fprintf(fp, "  }\n");
     fprintf(fp, "}\n");
@@ -115,6 +1904,9 @@ static void write_profile_data(void) {
     printf("\n=== Dangerous API Profiling Results ===\n");
     printf("Total dangerous API calls: %lu\n", total_calls);
     printf("Unique call sites: %d\n", num_entries);
+    if (elided > 0) {
+        printf("Elided call sites: %d\n", elided);
+    }
     printf("Results written to: dangerous_api_profile.json\n\n");
     
     printf("Top call sites:\n");
@@ -127,10 +1919,63 @@ static void write_profile_data(void) {
     }
 }
 
+// Calls set(api, value) for each API of a comma-separated list, or once
+// with NULL for "all"
+static void apply_api_list(const char *apis, int (*set)(const char *, int),
+                           int value) {
+    if (strcmp(apis, "all") == 0) {
+        set(NULL, value);
+        return;
+    }
+    char *list = strdup(apis);
+    char *save = NULL;
+    for (char *api = list ? strtok_r(list, ",", &save) : NULL; api;
+         api = strtok_r(NULL, ",", &save)) {
+        set(api, value);
+    }
+    free(list);
+}
+
 // Constructor to register exit handler
 __attribute__((constructor))
 static void profiling_init(void) {
     if (!initialized) {
+        const char *depth = getenv("DANGEROUS_API_STACK_DEPTH");
+        if (depth) {
+            stack_depth = atoi(depth);
+            if (stack_depth < 0) {
+                stack_depth = 0;
+            } else if (stack_depth > MAX_STACK_DEPTH) {
+                stack_depth = MAX_STACK_DEPTH;
+            }
+        }
+        const char *topk = getenv("DANGEROUS_API_TOPK");
+        if (topk) {
+            topk_size = atoi(topk);
+            if (topk_size < 0) {
+                topk_size = 0;
+            } else if (topk_size > MAX_TOPK) {
+                topk_size = MAX_TOPK;
+            }
+        }
+        const char *interval = getenv("DANGEROUS_API_SAMPLE_INTERVAL");
+        if (interval) {
+            int n = atoi(interval);
+            __dangerous_api_sample_interval = n > 0 ? n : 1;
+            __dangerous_api_sample_countdown = __dangerous_api_sample_interval;
+        }
+        const char *sleds = getenv("DANGEROUS_API_SLEDS");
+        if (sleds) {
+            apply_api_list(sleds, profiling_patch_sleds, 1);
+        }
+        const char *gates_off = getenv("DANGEROUS_API_GATES_OFF");
+        if (gates_off) {
+            apply_api_list(gates_off, profiling_set_gates, 0);
+        }
+        const char *gates_shm = getenv("DANGEROUS_API_GATES_SHM");
+        if (gates_shm) {
+            start_gate_control(gates_shm);
+        }
         atexit(write_profile_data);
         initialized = 1;
     }
@@ -0,0 +1,15 @@
+//test program - strcpy() with varying copy sizes
+
+#include<stdio.h>
+#include<string.h>
+
+int main(){
+    char buf[256];
+    char src[200];
+    for (int i = 0; i < 200; i++) {
+        memset(src, 'x', i);
+        src[i] = '\0';
+        strcpy(buf, src);
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+//test program - printf() inside a try region (compiles to an invoke)
+//glibc declares the string functions noexcept, so a strcpy() here would
+//still be a plain call; printf() is a cancellation point and may throw
+
+#include<cstdio>
+#include<stdexcept>
+
+static void check(const char *s){
+    if (!s[0]) throw std::runtime_error("empty");
+}
+
+int main(int argc, char **argv){
+    const char *name = argc > 1 ? argv[1] : "";
+    try {
+        printf("copying '%s'\n", name);
+        check(name);
+    } catch (const std::exception &e) {
+        printf("%s\n", e.what());
+    }
+    return 0;
+}
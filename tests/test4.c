@@ -0,0 +1,20 @@
+//test program - strcpy() reached through a function-pointer table
+
+#include<stdio.h>
+#include<string.h>
+
+typedef char *(*copy_fn)(char *, const char *);
+
+static char *copy_checked(char *dst, const char *src){
+    return strncpy(dst, src, 15);
+}
+
+static copy_fn strategies[] = { strcpy, copy_checked };
+
+int main(){
+    char a[16];
+    for (int i = 0; i < 4; i++) {
+        strategies[i % 2](a, "hello");
+    }
+    return 0;
+}
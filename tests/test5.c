@@ -0,0 +1,18 @@
+//test program - strcpy() in a loop nest whose outer index is used after the inner loop
+
+#include<stdio.h>
+#include<string.h>
+
+int main(int argc, char **argv){
+    char buf[256];
+    const char *src = argc > 1 ? argv[1] : "hello";
+    unsigned long total = 0;
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < i; j++) {
+            strcpy(buf, src);
+        }
+        total += i;
+    }
+    printf("%lu\n", total);
+    return 0;
+}